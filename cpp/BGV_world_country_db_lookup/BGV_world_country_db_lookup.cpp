@@ -32,6 +32,9 @@
 
 // See more information about this demo in the readme file.
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 
 #include "helayers/hebase/hebase.h"
@@ -39,21 +42,423 @@
 #include "helayers/hebase/openfhe/OpenFheDcrtEncoder.h"
 #include "helayers/hebase/openfhe/OpenFheDcrtCiphertext.h"
 #include "helayers/math/MathUtils.h"
+#include <condition_variable>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
 
 using namespace helayers;
 using namespace std;
 
+// A pool of encoded plaintext constants, such as masks, that every search
+// uses. They are encoded once per query session and then shared by all the
+// searches, including those running in parallel threads.
+class ConstantPool
+{
+public:
+  explicit ConstantPool(const HeContext& he) : he(he) {}
+
+  // Encode vals and store them under the given name
+  void add(const string& name, const vector<int>& vals)
+  {
+    Encoder enc(he);
+    PTile p(he);
+    enc.encode(p, vals);
+    pool.insert_or_assign(name, p);
+  }
+
+  // Return the constant stored under the given name
+  const PTile& get(const string& name) const
+  {
+    auto it = pool.find(name);
+    if (it == pool.end())
+      throw runtime_error("Constant " + name + " was not added to the pool");
+    return it->second;
+  }
+
+private:
+  const HeContext& he;
+  map<string, PTile> pool;
+};
+
+// The equality test raises differences to the power p-1, where p is the
+// plaintext modulus (see Fermat's little theorem below). This class finds an
+// addition chain for p-1 once at startup: a sequence 1 = a_0 < a_1 < ... <
+// a_n = p-1 where every element is the sum of two earlier ones, so x^(p-1)
+// takes n multiplications. Among the shortest chains it picks one of least
+// multiplication depth.
+class EqualityKernel
+{
+public:
+  explicit EqualityKernel(int exponent)
+  {
+    always_assert(exponent >= 1);
+    // p-1 = odd * 2^k. The odd part gets a searched chain, and the rest
+    // is k squarings.
+    int odd = exponent;
+    int doublings = 0;
+    while (odd % 2 == 0) {
+      odd /= 2;
+      doublings++;
+    }
+    findOddChain(odd);
+    for (int i = 0; i < doublings; ++i)
+      addStep(chain.size() - 1, chain.size() - 1);
+  }
+
+  // Raise ctile to the power of the exponent, in place
+  void apply(CTile& ctile) const
+  {
+    vector<CTile> powers;
+    powers.reserve(chain.size());
+    powers.push_back(ctile);
+    for (size_t k = 1; k < chain.size(); ++k) {
+      CTile power = powers[steps[k].first];
+      if (steps[k].first == steps[k].second)
+        power.square();
+      else
+        power.multiply(powers[steps[k].second]);
+      powers.push_back(std::move(power));
+    }
+    ctile = powers.back();
+  }
+
+  const vector<int>& getChain() const { return chain; }
+
+  int getMultiplications() const { return chain.size() - 1; }
+
+  int getDepth() const { return depths.back(); }
+
+private:
+  // Odd parts above this use the binary method, whose chains are at most
+  // a few steps longer, instead of a search.
+  static const int maxSearchedOdd = 511;
+
+  // chain[k] = chain[steps[k].first] + chain[steps[k].second]
+  vector<int> chain = {1};
+  vector<pair<int, int>> steps = {{0, 0}};
+  vector<int> depths = {0};
+
+  void addStep(int i, int j)
+  {
+    chain.push_back(chain[i] + chain[j]);
+    steps.emplace_back(i, j);
+    depths.push_back(max(depths[i], depths[j]) + 1);
+  }
+
+  void findOddChain(int odd)
+  {
+    if (odd == 1)
+      return;
+    if (odd > maxSearchedOdd) {
+      // Left-to-right binary method: square for every bit after the
+      // leading one, and multiply by x for every set bit
+      int bit = 0;
+      while ((odd >> (bit + 1)) > 0)
+        bit++;
+      while (bit-- > 0) {
+        addStep(chain.size() - 1, chain.size() - 1);
+        if ((odd >> bit) & 1)
+          addStep(chain.size() - 1, 0);
+      }
+      return;
+    }
+
+    // Iterative deepening: the first length with a chain is the shortest,
+    // and all the chains of that length are searched for the shallowest.
+    int minDepth = ceil(log2(odd));
+    for (int length = 1; bestChain.empty(); ++length)
+      searchChains(odd, length, minDepth);
+    chain = bestChain;
+    steps = bestSteps;
+    depths = bestDepths;
+  }
+
+  vector<int> bestChain;
+  vector<pair<int, int>> bestSteps;
+  vector<int> bestDepths;
+
+  // Returns true once a chain of the least possible depth was found
+  bool searchChains(int target, int length, int minDepth)
+  {
+    int n = chain.size() - 1;
+    if (chain.back() == target) {
+      if (bestChain.empty() || depths.back() < bestDepths.back()) {
+        bestChain = chain;
+        bestSteps = steps;
+        bestDepths = depths;
+      }
+      return depths.back() == minDepth;
+    }
+    // Every step at most doubles the largest element
+    if (n == length || ((long)chain.back() << (length - n)) < target)
+      return false;
+    for (int i = n; i >= 0; --i)
+      for (int j = i; j >= 0; --j) {
+        int next = chain[i] + chain[j];
+        if (next <= chain.back() || next > target)
+          continue;
+        addStep(i, j);
+        bool done = searchChains(target, length, minDepth);
+        chain.pop_back();
+        steps.pop_back();
+        depths.pop_back();
+        if (done)
+          return true;
+      }
+    return false;
+  }
+};
+
+// Every database string is stored in a segment of segmentSlots slots,
+// and the segments of many entries are packed side by side in a single
+// ciphertext. The segment size is derived from the database: the longest
+// name rounded up to a power of 2, so the rotations of a comparison only
+// span the slots the names use. A country longer than a ciphertext is split
+// into keyParts parts of segmentSlots characters, each in its own
+// ciphertext.
+struct SegmentLayout
+{
+  int segmentSlots = 1;
+  int keyParts = 1;
+};
+
+// The countries and capitals of entriesPerCtile entries. The i'th
+// ciphertext of countries holds the i'th part of every country.
+struct EncryptedPair
+{
+  EncryptedPair(HeContext& he, int keyParts)
+      : countries(keyParts, CTile(he)), capitals(he)
+  {
+  }
+
+  vector<CTile> countries;
+  CTile capitals;
+};
+
+// Assigns every country to one of numBuckets buckets with a keyed hash. The
+// client reveals the bucket of its query to the server, which then only
+// searches the ciphertexts of that bucket. Without the key the server can't
+// tell which countries fall in a bucket, but the bucket itself leaks about
+// log2(numBuckets) bits of the query: more buckets mean less work and more
+// leakage.
+//
+// The hash is FNV-1a seeded with the key, followed by a 64-bit finalizer.
+// It is good enough for a demo; a real deployment should use a keyed PRF
+// such as HMAC.
+class BucketHash
+{
+public:
+  // A single bucket, which needs no key
+  BucketHash() {}
+
+  // A random key, for numBuckets buckets
+  explicit BucketHash(int numBuckets) : numBuckets(numBuckets)
+  {
+    always_assert(numBuckets >= 1);
+    random_device rd;
+    key = (uint64_t(rd()) << 32) | rd();
+  }
+
+  int bucketOf(const string& val) const
+  {
+    if (numBuckets == 1)
+      return 0;
+    uint64_t h = 14695981039346656037ULL ^ key;
+    for (unsigned char c : val) {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h % numBuckets;
+  }
+
+  int getNumBuckets() const { return numBuckets; }
+
+  // The key is a secret of the client, like the secret key of the context
+  void saveToFile(const string& path) const
+  {
+    ofstream out(path, ios::out | ios::binary);
+    out.write(reinterpret_cast<const char*>(&numBuckets), sizeof(numBuckets));
+    out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+    if (!out)
+      throw runtime_error("Failed to write " + path);
+  }
+
+  void loadFromFile(const string& path)
+  {
+    ifstream in(path, ios::in | ios::binary);
+    in.read(reinterpret_cast<char*>(&numBuckets), sizeof(numBuckets));
+    in.read(reinterpret_cast<char*>(&key), sizeof(key));
+    if (!in || numBuckets < 1)
+      throw runtime_error("Failed to read " + path);
+  }
+
+private:
+  int32_t numBuckets = 1;
+  uint64_t key = 0;
+};
+
 // Forward declarations. These functions are explained later.
-vector<pair<string, string>> read_csv(const string& filename, int maxLen);
+class EncryptedDb;
+vector<pair<string, string>> read_csv(const string& filename);
+SegmentLayout chooseLayout(const vector<pair<string, string>>& country_db,
+                           int numSlots);
 void run(HeContext& he,
-         const string& db_filename,
+         const EncryptedDb& db,
          const std::string& countryName,
+         int entryIndex,
          bool debug,
-         int plaintextModulus);
+         const EqualityKernel& kernel,
+         const BucketHash& bucketHash,
+         bool parallel);
+void serve(HeContext& he,
+           const EncryptedDb& db,
+           const EqualityKernel& kernel,
+           const BucketHash& bucketHash,
+           bool parallel,
+           int numWorkers);
+vector<CTile> encryptQuery(HeContext& he,
+                           const EncryptedDb& db,
+                           const string& query_string);
+vector<CTile> encryptIndexQuery(HeContext& he,
+                                const EncryptedDb& db,
+                                int entryIndex);
+string decryptResult(HeContext& he, const EncryptedDb& db, const CTile& value);
+CTile searchEntry(const ConstantPool& constants,
+                  const vector<CTile>& query,
+                  const EncryptedPair& encrypted_pair,
+                  const EqualityKernel& kernel,
+                  int segmentSlots,
+                  bool lazyRelinearization);
+bool supportsLazyRelinearization(HeContext& he);
+void treeSum(vector<CTile>& vals);
 vector<int> stringToAscii(const string& val);
+vector<int> packStrings(const vector<string>& vals,
+                        int segmentSlots,
+                        int numSlots,
+                        int part = 0);
 void usage();
 
+// The encrypted database: a vector of pairs of countries and capitals
+// CTile-s. A CTile is a ciphertext object. The i'th pair holds the
+// countries and capitals of entriesPerCtile consecutive entries.
+//
+// The entries are grouped by their bucket, and every bucket is packed into
+// its own consecutive range of pairs, so a bucket can be searched alone.
+//
+// The database can be saved to a binary index file by an offline step, and
+// opened by the query process without encrypting anything. The file holds
+// a header (magic, version, plaintext modulus, slot count, segment size,
+// number of entries and of pairs, the number of buckets followed by the
+// number of pairs of every bucket, and the number of key parts), followed by
+// the serialized ciphertexts, each preceded by its size.
+class EncryptedDb
+{
+public:
+  // Encrypt the database
+  EncryptedDb(HeContext& he,
+              const vector<pair<string, string>>& country_db,
+              int plaintextModulus,
+              const SegmentLayout& layout,
+              const BucketHash& bucketHash);
+
+  // Open an index file written by save(). Only the header is read here,
+  // and the ciphertexts on first use.
+  EncryptedDb(HeContext& he, const string& path);
+
+  void save(const string& path) const;
+
+  // Return the pairs, reading them from the index file if needed
+  const vector<EncryptedPair>& getPairs() const;
+
+  int getNumEntries() const { return numEntries; }
+
+  int getNumPairs() const { return numPairs; }
+
+  // The number of segments of all the pairs. Retrieval by index addresses
+  // the segments in this order; with a single bucket, these are the entries
+  // in their order in the database, followed by empty segments.
+  int getNumSegments() const
+  {
+    return numPairs * (he.slotCount() / layout.segmentSlots);
+  }
+
+  int getSegmentSlots() const { return layout.segmentSlots; }
+
+  int getKeyParts() const { return layout.keyParts; }
+
+  int getNumBuckets() const { return bucketBegin.size() - 1; }
+
+  // The pairs of bucket b are [getBucketBegin(b), getBucketBegin(b + 1))
+  int getBucketBegin(int bucket) const { return bucketBegin.at(bucket); }
+
+  int getPlaintextModulus() const { return plaintextModulus; }
+
+private:
+  static constexpr char magic[8] = {'B', 'G', 'V', 'L', 'O', 'O', 'K', 'P'};
+  static const uint32_t version = 1;
+
+  HeContext& he;
+  int plaintextModulus = 0;
+  int numEntries = 0;
+  int numPairs = 0;
+  SegmentLayout layout;
+  vector<int> bucketBegin;
+  string path;
+  streamoff dataOffset = 0;
+
+  mutable once_flag loadOnce;
+  mutable vector<EncryptedPair> pairs;
+
+  // Read the header of an index file, leaving in at the first ciphertext
+  void readHeader(istream& in);
+
+  void load() const;
+};
+
+// The server side of the search: the encrypted database, and everything
+// that is prepared once per session to search it. search() may be called
+// from several threads at once.
+class SearchEngine
+{
+public:
+  SearchEngine(HeContext& he,
+               const EncryptedDb& db,
+               const EqualityKernel& kernel,
+               bool parallel);
+
+  // Return the capital of the country matching the encrypted query, in the
+  // first segment, or 0s if no country matches. Only the countries of the
+  // given bucket are searched.
+  CTile search(const vector<CTile>& query, int bucket = 0) const;
+
+  // Return the capital of the entry selected by an encrypted one-hot
+  // selector, in the first segment. See encryptIndexQuery().
+  CTile retrieve(const vector<CTile>& selector) const;
+
+  bool usesLazyRelinearization() const { return lazyRelinearization; }
+
+private:
+  HeContext& he;
+  const EncryptedDb& db;
+  const vector<EncryptedPair>& encrypted_country_db;
+  const EqualityKernel& kernel;
+  ConstantPool constants;
+  bool lazyRelinearization;
+  bool parallel;
+
+  // Sum the results of all the packed ciphertexts, at most one of which is
+  // not 0s, and move it to the first segment
+  CTile reduce(vector<CTile>& results) const;
+};
+
 int main(int argc, char* argv[])
 {
   // Note: The parameters have been chosen to provide a somewhat
@@ -64,11 +469,39 @@ int main(int argc, char* argv[])
   string db_filename = getDataSetsDir() + "/countries/countries.csv";
   // debug output (default no debug output)
   bool debug = false;
+  // search the database entries in parallel threads
+  bool parallel = false;
 
   int plaintextModulus = 257; // 786433;
 
+  // Number of slots in each ciphertext. The database entries are packed
+  // side by side, a segment each, so more slots means fewer
+  // ciphertexts to search. Batching requires the plaintext modulus to be
+  // 1 modulo twice the number of slots: 257 allows up to 128 slots and
+  // 786433 up to 131072.
+  int numSlots = 128;
+
   string countryName = "";
 
+  // With entry, the capital at this position of the database is retrieved
+  // by its index, without comparing any country names
+  int entryIndex = -1;
+
+  // With build_index, the encrypted database, the HE context and its
+  // secret key are saved to this directory, and the program exits. With
+  // index, they are loaded from it instead of being created.
+  string buildIndexDir = "";
+  string indexDir = "";
+
+  // With buckets, the countries are split into this many buckets by a keyed
+  // hash, and a query searches only the bucket of its country
+  int numBuckets = 1;
+
+  // With server, queries are read from the standard input, one per line,
+  // and answered by a pool of worker threads
+  bool server = false;
+  int numWorkers = 2;
+
   int i = 1;
   while (i < argc) {
     string arg = argv[i++];
@@ -78,12 +511,28 @@ int main(int argc, char* argv[])
     }
     if (arg == "--plaintext_modulus")
       plaintextModulus = atoi(argv[i++]);
+    else if (arg == "--slots")
+      numSlots = atoi(argv[i++]);
     else if (arg == "--db_filename")
       db_filename = argv[i++];
     else if (arg == "--country")
       countryName = argv[i++];
+    else if (arg == "--entry")
+      entryIndex = atoi(argv[i++]);
     else if (arg == "--debug")
       debug = true;
+    else if (arg == "--parallel")
+      parallel = true;
+    else if (arg == "--build_index")
+      buildIndexDir = argv[i++];
+    else if (arg == "--index")
+      indexDir = argv[i++];
+    else if (arg == "--buckets")
+      numBuckets = atoi(argv[i++]);
+    else if (arg == "--server")
+      server = true;
+    else if (arg == "--workers")
+      numWorkers = atoi(argv[i++]);
     else
       throw runtime_error("Unsupported argument: " + arg);
   }
@@ -99,6 +548,37 @@ int main(int argc, char* argv[])
   cout << "\n*********************************************************";
   cout << endl;
 
+  if (!indexDir.empty()) {
+    // The query process loads everything the index step saved, so it
+    // neither generates keys nor encrypts the database. It plays both the
+    // client and the server, so it also loads the secret key, which a real
+    // server must never hold: there context.bin and db.bin would go to the
+    // server, and secretKey.bin and bucketKey.bin stay with the client.
+    cout << "---Loading the index from " << indexDir << " ... " << endl;
+    HELAYERS_TIMER_PUSH("LoadIndex");
+    shared_ptr<HeContext> he = loadHeContextFromFile(indexDir + "/context.bin");
+    he->loadSecretKeyFromFile(indexDir + "/secretKey.bin");
+    EncryptedDb db(*he, indexDir + "/db.bin");
+    BucketHash bucketHash;
+    if (db.getNumBuckets() > 1)
+      bucketHash.loadFromFile(indexDir + "/bucketKey.bin");
+    always_assert(bucketHash.getNumBuckets() == db.getNumBuckets());
+    HELAYERS_TIMER_POP();
+    EqualityKernel kernel(db.getPlaintextModulus() - 1);
+    if (server)
+      serve(*he, db, kernel, bucketHash, parallel, numWorkers);
+    else
+      run(*he,
+          db,
+          countryName,
+          entryIndex,
+          debug,
+          kernel,
+          bucketHash,
+          parallel);
+    return 0;
+  }
+
   cout << "---Initialising HE Environment ... ";
   // Initialize context
   cout << "\nInitializing the Context ... " << endl;
@@ -114,7 +594,31 @@ int main(int argc, char* argv[])
   // to handle the numbers 0...127
   always_assert(plaintextModulus >= 127);
 
-  HeConfigRequirement req = HeConfigRequirement::insecure(32, 16);
+  // Now we'll read in the database (in cleartext). The segment size, and
+  // with it the depth of the search, depends on its longest names, so it
+  // is read before the context is initialized.
+  vector<pair<string, string>> country_db = read_csv(db_filename);
+  SegmentLayout layout = chooseLayout(country_db, numSlots);
+  cout << "Segment size: " << layout.segmentSlots << " slots, "
+       << layout.keyParts << " ciphertexts per country" << endl;
+
+  // The equality test dominates the multiplication depth of the search, so
+  // its addition chain is chosen first, and the depth of the context is set
+  // to what the search consumes: the chain, combining the key parts,
+  // log2(segmentSlots) levels of rotate-and-multiply, the segment mask and
+  // the capital.
+  EqualityKernel kernel(plaintextModulus - 1);
+  int depth = kernel.getDepth() + (int)ceil(log2(layout.keyParts)) +
+              (int)log2(layout.segmentSlots) + 2;
+  cout << "Equality kernel: x^" << plaintextModulus - 1 << " in "
+       << kernel.getMultiplications() << " multiplications, depth "
+       << kernel.getDepth() << ". Addition chain:";
+  for (int a : kernel.getChain())
+    cout << " " << a;
+  cout << endl;
+  cout << "Search depth: " << depth << endl;
+
+  HeConfigRequirement req = HeConfigRequirement::insecure(numSlots, depth);
   req.plaintextModulus = plaintextModulus;
   HELAYERS_TIMER_PUSH("Initialization");
 
@@ -122,8 +626,33 @@ int main(int argc, char* argv[])
   HELAYERS_TIMER_POP();
 
   // OpenFHE-BGV is now ready to start doing some HE work.
-  // which we'll do in the following function, defined below
-  run(he, db_filename, countryName, debug, plaintextModulus);
+  always_assert(he.slotCount() % layout.segmentSlots == 0);
+
+  // We'll now encrypt our country-capital database.
+  cout << "\n---Encrypting the key,value pair database ("
+       << country_db.size() << " entries)..." << endl;
+  BucketHash bucketHash(numBuckets);
+  HELAYERS_TIMER_PUSH("CountryDB");
+  EncryptedDb db(he, country_db, plaintextModulus, layout, bucketHash);
+  HELAYERS_TIMER_POP();
+
+  if (!buildIndexDir.empty()) {
+    cout << "---Saving the index to " << buildIndexDir << " ..." << endl;
+    FileUtils::createCleanDir(buildIndexDir);
+    // The context file holds no secret key, which is saved separately
+    he.saveToFile(buildIndexDir + "/context.bin");
+    he.saveSecretKeyToFile(buildIndexDir + "/secretKey.bin");
+    db.save(buildIndexDir + "/db.bin");
+    if (numBuckets > 1)
+      bucketHash.saveToFile(buildIndexDir + "/bucketKey.bin");
+    return 0;
+  }
+
+  // The search is done in the following functions, defined below
+  if (server)
+    serve(he, db, kernel, bucketHash, parallel, numWorkers);
+  else
+    run(he, db, countryName, entryIndex, debug, kernel, bucketHash, parallel);
 
   return 0;
 }
@@ -133,43 +662,39 @@ void usage()
   cout << "Usage:" << endl;
   cout << endl;
   cout << "\t--plaintext_modulus\t\tPlaintext modulus" << endl;
+  cout << "\t--slots\t\t\t\tNumber of slots in each ciphertext" << endl;
   cout << "\t--db_filename\t\t\tQualified name for the database filename"
        << endl;
   cout << "\t--country <int>\t\t\tCountry to search for" << endl;
   cout << "\t---debug\t\t\tDebug" << endl;
+  cout << "\t--parallel\t\t\tSearch the database in parallel threads"
+       << endl;
+  cout << "\t--build_index <dir>\t\tEncrypt the database, save it with the "
+          "HE context to dir, and exit"
+       << endl;
+  cout << "\t--index <dir>\t\t\tLoad the database and the HE context "
+          "from dir instead of encrypting"
+       << endl;
+  cout << "\t--entry <i>\t\t\tRetrieve the capital of the i'th entry "
+          "by its index"
+       << endl;
+  cout << "\t--buckets <n>\t\t\tSplit the countries into n hash buckets"
+       << endl;
+  cout << "\t--server\t\t\tAnswer queries read from stdin, one per line"
+       << endl;
+  cout << "\t--workers <n>\t\t\tNumber of worker threads of the server"
+       << endl;
   cout << endl;
 }
 
-void pow(HeContext& he, CTile& ctile, int degree)
-{
-  bool yIsOne = true;
-  CTile y(he);
-  CTile x = ctile;
-
-  while (degree > 1) {
-    if ((degree % 2) == 0) {
-      ctile.square();
-      degree = degree / 2;
-    } else {
-      if (yIsOne) {
-        y = ctile;
-        yIsOne = false;
-      } else {
-        y.multiply(ctile);
-      }
-      ctile.square();
-      degree = (degree - 1) / 2;
-    }
-  }
-  if (!yIsOne)
-    ctile.multiply(y);
-}
-
 void run(HeContext& he,
-         const string& db_filename,
+         const EncryptedDb& db,
          const std::string& countryName,
+         int entryIndex,
          bool debug,
-         int plaintextModulus)
+         const EqualityKernel& kernel,
+         const BucketHash& bucketHash,
+         bool parallel)
 {
 
   // The run function receives an abstract HeContext class.
@@ -193,44 +718,44 @@ void run(HeContext& he,
   // Each ciphertext will have this many slots.
   cout << "\nNumber of slots: " << he.slotCount() << endl;
 
-  // Now we'll read in the database (in cleartext).
-  // This function we'll make sure no string is longer than he.slotCount()
-  vector<pair<string, string>> country_db =
-      read_csv(db_filename, he.slotCount());
+  cout << "\n---Encrypted key,value pair database: " << db.getNumEntries()
+       << " entries, " << he.slotCount() / db.getSegmentSlots()
+       << " per ciphertext, " << db.getNumBuckets() << " buckets" << endl;
 
-  cout << "\n---Initializing the encrypted key,value pair database ("
-       << country_db.size() << " entries)...";
-  cout << "\nConverting strings to numeric representation into Ptxt objects "
-          "..."
+  SearchEngine engine(he, db, kernel, parallel);
+  cout << "\nLazy relinearization: "
+       << (engine.usesLazyRelinearization() ? "enabled" : "not supported")
        << endl;
 
-  // We'll now encrypt our country-capital database.
-  HELAYERS_TIMER_PUSH("CountryDB");
-  // The encoder class handles both encoding and encrypting.
-  Encoder enc(he);
-  // This is the database: a vector of pairs of CTile-s.
-  // A CTile is a ciphertext object.
-  vector<pair<CTile, CTile>> encrypted_country_db;
-  for (const auto& country_capital_pair : country_db) {
-    // Create a country ciphertext, and encrypt inside
-    // the ascii vector representation of each country.
-    // For example, Norway is represented
-    // (78,111,114,119,97,121,  0,0,0, ...)
-    CTile country(he);
-    enc.encodeEncrypt(country, stringToAscii(country_capital_pair.first));
-    // Similarly encrypt the capital name
-    CTile capital(he);
-    enc.encodeEncrypt(capital, stringToAscii(country_capital_pair.second));
-    // Add the pair to the database
-
-    vector<int> resInt = enc.decryptDecodeInt(country);
-    encrypted_country_db.emplace_back(std::move(country), std::move(capital));
-  }
-  HELAYERS_TIMER_POP();
-
   cout << "\nInitialization Completed - Ready for Queries" << endl;
   cout << "--------------------------------------------" << endl;
 
+  if (entryIndex >= 0) {
+    // Retrieval by index needs no equality test: the selector is multiplied
+    // with the capitals and summed, one multiplication deep.
+    cout << "Retrieving the Capital of entry " << entryIndex << endl;
+
+    HELAYERS_TIMER_PUSH("TotalQuery");
+    HELAYERS_TIMER_PUSH("EncryptQuery");
+    vector<CTile> selector = encryptIndexQuery(he, db, entryIndex);
+    HELAYERS_TIMER_POP();
+
+    HELAYERS_TIMER_PUSH("QueryRetrieve");
+    CTile value = engine.retrieve(selector);
+    HELAYERS_TIMER_POP();
+
+    HELAYERS_TIMER_PUSH("DecryptQueryResult");
+    string string_result = decryptResult(he, db, value);
+    HELAYERS_TIMER_POP();
+
+    HELAYERS_TIMER_POP();
+
+    if (debug)
+      HELAYERS_TIMER_PRINT_MEASURES_SUMMARY_FLAT();
+    cout << "\nQuery result: " << string_result << endl;
+    return;
+  }
+
   /** Create the query **/
 
   // Read in query from the command line
@@ -246,108 +771,616 @@ void run(HeContext& he,
 
   HELAYERS_TIMER_PUSH("TotalQuery");
   HELAYERS_TIMER_PUSH("EncryptQuery");
-
-  // Encrypt the query similar to the way we encrypted
-  // the country and capital names
-  CTile query(he);
-  enc.encodeEncrypt(query, stringToAscii(query_string));
-
+  vector<CTile> query = encryptQuery(he, db, query_string);
   HELAYERS_TIMER_POP();
 
   /************ Perform the database search ************/
 
+  // The bucket of the query is revealed to the server
+  int bucket = bucketHash.bucketOf(query_string);
+  if (db.getNumBuckets() > 1)
+    cout << "Searching bucket " << bucket << ": "
+         << db.getBucketBegin(bucket + 1) - db.getBucketBegin(bucket)
+         << " of " << db.getNumPairs() << " ciphertexts" << endl;
+
   HELAYERS_TIMER_PUSH("QuerySearch");
-  vector<CTile> mask;
-  mask.reserve(country_db.size());
-
-  // For every entry in our database we perform the following
-  // calculation:
-  for (const auto& encrypted_pair : encrypted_country_db) {
-    //  Copy of database key: a country name
-    CTile mask_entry = encrypted_pair.first;
+  CTile value = engine.search(query, bucket);
+  HELAYERS_TIMER_POP();
+
+  // /************ Decrypt and print result ************/
+
+  HELAYERS_TIMER_PUSH("DecryptQueryResult");
+  string string_result = decryptResult(he, db, value);
+  HELAYERS_TIMER_POP();
+
+  HELAYERS_TIMER_POP();
+
+  if (string_result.empty()) {
+    string_result = "Country name not in the database.\n*** Please make sure "
+                    "to enter the name of an European Country\n*** with the "
+                    "first letter in upper case.";
+  }
+  if (debug)
+    HELAYERS_TIMER_PRINT_MEASURES_SUMMARY_FLAT();
+  cout << "\nQuery result: " << string_result << endl;
+}
+
+// Answer a stream of queries, one country name per line of the standard
+// input, until it ends. A line #i retrieves the capital of the i'th entry by
+// its index instead. The context, the database and the search engine are
+// initialized once, so every query only pays for its search. The main
+// thread encrypts the queries into a request queue, and a pool of worker
+// threads searches them and decrypts the results, which are printed as
+// they complete.
+void serve(HeContext& he,
+           const EncryptedDb& db,
+           const EqualityKernel& kernel,
+           const BucketHash& bucketHash,
+           bool parallel,
+           int numWorkers)
+{
+  always_assert(he.getTraits().isModularArithmetic());
+  always_assert(numWorkers >= 1);
+  SearchEngine engine(he, db, kernel, parallel);
+
+  // The encrypted parts of the query of a search, or the selector of a
+  // retrieval by index
+  struct Request
+  {
+    int id;
+    string query_string;
+    bool byIndex;
+    vector<CTile> query;
+    int bucket;
+  };
+  queue<Request> requests;
+  bool done = false;
+  mutex mtx;
+  condition_variable ready;
+  mutex outputMtx;
+
+  auto worker = [&]() {
+    while (true) {
+      unique_lock<mutex> lock(mtx);
+      ready.wait(lock, [&]() { return done || !requests.empty(); });
+      if (requests.empty())
+        return;
+      Request request = std::move(requests.front());
+      requests.pop();
+      lock.unlock();
+
+      auto start = chrono::steady_clock::now();
+      string string_result =
+          decryptResult(he,
+                        db,
+                        request.byIndex
+                            ? engine.retrieve(request.query)
+                            : engine.search(request.query, request.bucket));
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      if (string_result.empty())
+        string_result = "Country name not in the database.";
+
+      lock_guard<mutex> outputLock(outputMtx);
+      cout << "Query " << request.id << " (" << elapsed.count() << " s)"
+           << endl;
+      cout << "Query result for " << request.query_string << ": "
+           << string_result << endl;
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 0; i < numWorkers; ++i)
+    workers.emplace_back(worker);
+
+  {
+    lock_guard<mutex> outputLock(outputMtx);
+    cout << "\nServer ready with " << numWorkers
+         << " workers - one country name per line" << endl;
+  }
+
+  string query_string;
+  for (int id = 0; getline(cin, query_string); ++id) {
+    if (query_string.empty())
+      continue;
+    Request request{id, query_string, query_string[0] == '#', {}, 0};
+    if (request.byIndex) {
+      int entryIndex = atoi(query_string.c_str() + 1);
+      if (entryIndex < 0 || entryIndex >= db.getNumSegments()) {
+        lock_guard<mutex> outputLock(outputMtx);
+        cout << "Query result for " << query_string << ": "
+             << "No such entry." << endl;
+        continue;
+      }
+      request.query = encryptIndexQuery(he, db, entryIndex);
+    } else {
+      request.query = encryptQuery(he, db, query_string);
+      request.bucket = bucketHash.bucketOf(query_string);
+    }
+    lock_guard<mutex> lock(mtx);
+    requests.push(std::move(request));
+    ready.notify_one();
+  }
+
+  {
+    lock_guard<mutex> lock(mtx);
+    done = true;
+  }
+  ready.notify_all();
+  for (thread& t : workers)
+    t.join();
+}
+
+// Encrypt the query similar to the way we encrypted the country and
+// capital names, repeated in every segment so it is compared against all
+// the countries of a ciphertext at once, and split into the same parts
+vector<CTile> encryptQuery(HeContext& he,
+                           const EncryptedDb& db,
+                           const string& query_string)
+{
+  Encoder enc(he);
+  int segmentSlots = db.getSegmentSlots();
+  // A query longer than a country can be can't match any country
+  string padded = query_string;
+  if ((int)padded.size() > segmentSlots * db.getKeyParts())
+    padded.clear();
+  vector<string> repeated(he.slotCount() / segmentSlots, padded);
+  vector<CTile> query(db.getKeyParts(), CTile(he));
+  for (int part = 0; part < (int)query.size(); ++part)
+    enc.encodeEncrypt(
+        query[part],
+        packStrings(repeated, segmentSlots, he.slotCount(), part));
+  return query;
+}
+
+// Encrypt the selector of a retrieval by index: one ciphertext per packed
+// ciphertext of the database, all 0s except for the segment of the entry,
+// which is all 1s. The server can't tell which ciphertext holds the 1s, so
+// the index stays private.
+vector<CTile> encryptIndexQuery(HeContext& he,
+                                const EncryptedDb& db,
+                                int entryIndex)
+{
+  if (entryIndex < 0 || entryIndex >= db.getNumSegments())
+    throw runtime_error("Entry index " + to_string(entryIndex) +
+                        " out of range [0," + to_string(db.getNumSegments()) +
+                        ")");
+  Encoder enc(he);
+  int segmentSlots = db.getSegmentSlots();
+  int entriesPerCtile = he.slotCount() / segmentSlots;
+  int segmentStart = (entryIndex % entriesPerCtile) * segmentSlots;
+  vector<CTile> selector(db.getNumPairs(), CTile(he));
+  for (int p = 0; p < db.getNumPairs(); ++p) {
+    vector<int> vals(he.slotCount(), 0);
+    if (p == entryIndex / entriesPerCtile)
+      fill(vals.begin() + segmentStart,
+           vals.begin() + segmentStart + segmentSlots,
+           1);
+    enc.encodeEncrypt(selector[p], vals);
+  }
+  return selector;
+}
+
+// Decrypt the result of a search and convert it from ASCII to a string.
+// The capital is in the first segment, padded with 0s. Returns an empty
+// string if no country matched.
+string decryptResult(HeContext& he, const EncryptedDb& db, const CTile& value)
+{
+  Encoder enc(he);
+  vector<int> res = enc.decryptDecodeInt(value);
+  string string_result;
+  for (long i = 0; i < db.getSegmentSlots() && res[i] != 0; ++i)
+    string_result.push_back(static_cast<long>(res[i]));
+  return string_result;
+}
+
+SearchEngine::SearchEngine(HeContext& he,
+                           const EncryptedDb& db,
+                           const EqualityKernel& kernel,
+                           bool parallel)
+    : he(he),
+      db(db),
+      encrypted_country_db(db.getPairs()),
+      kernel(kernel),
+      constants(he),
+      parallel(parallel)
+{
+  int segmentSlots = db.getSegmentSlots();
+  always_assert(he.slotCount() % segmentSlots == 0);
+
+  // The products with the capitals are summed before they are used again,
+  // so their relinearization can be deferred to after the sum when the
+  // backend supports it.
+  lazyRelinearization = supportsLazyRelinearization(he);
+
+  // The plaintext constants of the search are encoded once, for all the
+  // queries of the session. The last slot of every segment is used to
+  // spread the result of a segment over all its slots.
+  vector<int> lastSlots(he.slotCount(), 0);
+  for (int slot = segmentSlots - 1; slot < he.slotCount(); slot += segmentSlots)
+    lastSlots[slot] = 1;
+  constants.add("lastSlots", lastSlots);
+}
+
+CTile SearchEngine::search(const vector<CTile>& query, int bucket) const
+{
+  int begin = db.getBucketBegin(bucket);
+  int end = db.getBucketBegin(bucket + 1);
+  if (begin == end) {
+    // An empty bucket holds no country to match
+    Encoder enc(he);
+    CTile value(he);
+    enc.encodeEncrypt(value, vector<int>(he.slotCount(), 0));
+    return value;
+  }
+  vector<CTile> mask(end - begin, CTile(he));
+
+  // For every packed ciphertext in our database we perform the
+  // calculation of searchEntry(), which compares the query against all
+  // its entries at once. The entries are independent, so with parallel
+  // every thread evaluates some of them and writes each result into its
+  // own preallocated slot of the vector.
+  if (!parallel) {
+    for (int i = begin; i < end; i++)
+      mask[i - begin] = searchEntry(constants,
+                                    query,
+                                    encrypted_country_db[i],
+                                    kernel,
+                                    db.getSegmentSlots(),
+                                    lazyRelinearization);
+  } else {
+#pragma omp parallel for schedule(dynamic)
+    for (int i = begin; i < end; i++)
+      mask[i - begin] = searchEntry(constants,
+                                    query,
+                                    encrypted_country_db[i],
+                                    kernel,
+                                    db.getSegmentSlots(),
+                                    lazyRelinearization);
+  }
+  return reduce(mask);
+}
+
+CTile SearchEngine::retrieve(const vector<CTile>& selector) const
+{
+  always_assert(selector.size() == encrypted_country_db.size());
+  vector<CTile> selected(selector);
+
+  // The selector already holds 1s in the segment of the entry, so a single
+  // multiplication by the capitals replaces the whole equality test
+#pragma omp parallel for if (parallel)
+  for (int i = 0; i < (int)selected.size(); i++) {
+    if (lazyRelinearization)
+      selected[i].multiplyRaw(encrypted_country_db[i].capitals);
+    else
+      selected[i].multiply(encrypted_country_db[i].capitals);
+  }
+  return reduce(selected);
+}
+
+CTile SearchEngine::reduce(vector<CTile>& results) const
+{
+  CTile value(he);
+  if (!parallel) {
+    // Aggregate the results into a single ciphertext
+    // Note: This code is for educational purposes and thus we try to
+    // refrain from using the STL and do not use std::accumulate
+    value = results[0];
+    for (int i = 1; i < (int)results.size(); i++)
+      value.add(results[i]);
+  } else {
+    // The results are summed in a tree, whose levels are computed in
+    // parallel
+    treeSum(results);
+    value = results[0];
+  }
+
+  if (lazyRelinearization)
+    value.relinearize();
+
+  // At most one segment holds a capital name, so a rotate-and-sum over the
+  // segments moves it to the first segment.
+  for (int rot = db.getSegmentSlots(); rot < he.slotCount(); rot *= 2) {
+    CTile tmp(value);
+    tmp.rotate(rot);
+    value.add(tmp);
+  }
+  return value;
+}
+
+// Compare the query against all the countries of a packed ciphertext,
+// and return the capital of the matching entry in its segment, and 0s in
+// all the other slots
+CTile searchEntry(const ConstantPool& constants,
+                  const vector<CTile>& query,
+                  const EncryptedPair& encrypted_pair,
+                  const EqualityKernel& kernel,
+                  int segmentSlots,
+                  bool lazyRelinearization)
+{
+  vector<CTile> parts;
+  for (int part = 0; part < (int)query.size(); ++part) {
+    //  Copy of database keys: the country names
+    CTile mask_entry = encrypted_pair.countries[part];
     // Calculate the difference
     // In each slot now we'll have 0 when characters match,
     // or non-zero when there's a mismatch
 
-    mask_entry.sub(query);
+    mask_entry.sub(query[part]);
 
     // Fermat's little theorem:
     // Since the underlying plaintext are in modular arithmetic,
     // Raising to the power of modulusP- 1 converts all non-zero values
-    // to 1.
+    // to 1. The kernel does it with a precomputed addition chain.
 
-    CTile res = mask_entry;
-    pow(he, res, plaintextModulus - 1);
+    kernel.apply(mask_entry);
 
     // Negate the ciphertext
     // Now we'll have 0 for match, -1 for mismatch
-    res.negate();
+    mask_entry.negate();
 
     // Add +1
     // Now we'll have 1 for match, 0 for mismatch
+    // Adding a scalar needs no encryption, and adds no noise of a fresh
+    // ciphertext.
 
-    vector<int> valsOne = vector<int>(he.slotCount(), 1);
-    CTile one(he);
-    enc.encodeEncrypt(one, valsOne);
-    res.add(one);
+    mask_entry.addScalar(1);
+    parts.push_back(mask_entry);
+  }
 
-    // We'll now multiply all slots together, since
-    // we want a complete match across all slots.
+  // A country matches only if all its parts match, so the parts are
+  // multiplied together, in a tree to keep the depth logarithmic
+  for (int stride = 1; stride < (int)parts.size(); stride *= 2)
+    for (int i = 0; i + stride < (int)parts.size(); i += 2 * stride)
+      parts[i].multiply(parts[i + stride]);
+  CTile res = parts[0];
+
+  // We'll now multiply the slots of every segment together, since
+  // we want a complete match across all the slots of an entry.
+
+  // Since the segment size is a power of 2 there's an
+  // efficient way to do it: we'll do a rotate-and-multiply algorithm,
+  // similar to a rotate-and-sum one. rotate(n) rotates left by n slots,
+  // so rotating by -rot brings every slot the value rot slots before it,
+  // and the last slot of every segment ends up with the product of the
+  // whole segment.
+
+  for (int rot = 1; rot < segmentSlots; rot *= 2) {
+    CTile tmp(res);
+    tmp.rotate(-rot);
+    res.multiply(tmp);
+  }
 
-    // If slot count is a power of 2 (our case 32) there's an efficient way
-    // to do it:
-    // we'll do a rotate-and-multiply algorithm, similar to
-    // a rotate-and-sum one.
+  // Keep only the last slot of every segment, and spread it back over
+  // the segment with a rotate-and-sum going the other way.
+  res.multiplyPlain(constants.get("lastSlots"));
+  for (int rot = 1; rot < segmentSlots; rot *= 2) {
+    CTile tmp(res);
+    tmp.rotate(rot);
+    res.add(tmp);
+  }
 
-    for (int rot = 1; rot < he.slotCount(); rot *= 2) {
-      CTile tmp(res);
-      tmp.rotate(-rot);
-      res.multiply(tmp);
-    }
+  // Every segment of mask_entry is now either all 1s if query==country,
+  // or all 0s otherwise.
+  // After we multiply by the capital names it will hold either
+  // the capital name, or all 0s. With lazy relinearization the product is
+  // relinearized only once, after all the results are summed.
+  if (lazyRelinearization)
+    res.multiplyRaw(encrypted_pair.capitals);
+  else
+    res.multiply(encrypted_pair.capitals);
+  return res;
+}
 
-    // mask_entry is now either all 1s if query==country,
-    // or all 0s otherwise.
-    // After we multiply by capital name it will be either
-    // the capital name, or all 0s.
-    res.multiply(encrypted_pair.second);
+// Check whether the backend supports multiplying without relinearization
+bool supportsLazyRelinearization(HeContext& he)
+{
+  Encoder enc(he);
+  CTile c(he);
+  enc.encodeEncrypt(c, vector<int>(he.slotCount(), 1));
+  try {
+    CTile product = c;
+    product.multiplyRaw(c);
+    product.relinearize();
+    return true;
+  } catch (const exception&) {
+    return false;
+  }
+}
 
-    // We collect all our findings.
-    mask.push_back(res);
+// Sum the ciphertexts into the first one. Level k adds every element at an
+// odd multiple of 2^k to the one 2^k before it, so the number of sequential
+// additions is logarithmic and the additions of a level run in parallel.
+void treeSum(vector<CTile>& vals)
+{
+  int n = vals.size();
+  for (int stride = 1; stride < n; stride *= 2) {
+#pragma omp parallel for
+    for (int i = 0; i < n - stride; i += 2 * stride)
+      vals[i].add(vals[i + stride]);
   }
-  HELAYERS_TIMER_POP();
+}
 
-  // Aggregate the results into a single ciphertext
-  // Note: This code is for educational purposes and thus we try to refrain
-  // from using the STL and do not use std::accumulate
-  CTile value = mask[0];
-  for (int i = 1; i < mask.size(); i++)
-    value.add(mask[i]);
+EncryptedDb::EncryptedDb(HeContext& he,
+                         const vector<pair<string, string>>& country_db,
+                         int plaintextModulus,
+                         const SegmentLayout& layout,
+                         const BucketHash& bucketHash)
+    : he(he),
+      plaintextModulus(plaintextModulus),
+      numEntries(country_db.size()),
+      layout(layout)
+{
+  // Group the entries by their bucket
+  vector<vector<pair<string, string>>> buckets(bucketHash.getNumBuckets());
+  for (const auto& entry : country_db)
+    buckets[bucketHash.bucketOf(entry.first)].push_back(entry);
 
-  // /************ Decrypt and print result ************/
+  // The encoder class handles both encoding and encrypting.
+  Encoder enc(he);
+  int segmentSlots = layout.segmentSlots;
+  int entriesPerCtile = he.slotCount() / segmentSlots;
+  bucketBegin.push_back(0);
+  for (const auto& bucket : buckets)
+    bucketBegin.push_back(bucketBegin.back() +
+                          (bucket.size() + entriesPerCtile - 1) /
+                              entriesPerCtile);
+  numPairs = bucketBegin.back();
+  pairs.assign(numPairs, EncryptedPair(he, layout.keyParts));
+  for (int b = 0; b < (int)buckets.size(); ++b) {
+    const auto& bucket = buckets[b];
+    for (int p = bucketBegin[b]; p < bucketBegin[b + 1]; ++p) {
+      vector<string> countries;
+      vector<string> capitals;
+      int first = (p - bucketBegin[b]) * entriesPerCtile;
+      for (int i = first;
+           i < (int)bucket.size() && i < first + entriesPerCtile;
+           ++i) {
+        countries.push_back(bucket[i].first);
+        capitals.push_back(bucket[i].second);
+      }
+      // Encrypt inside the country ciphertexts the ascii vector
+      // representation of its countries, one per segment.
+      // For example, Norway followed by Poland is represented
+      // (78,111,114,119,97,121,0,0,0, ... ,80,111,108,97,110,100,0,0,0, ...)
+      // A longer country continues in the same segment of the next part.
+      for (int part = 0; part < layout.keyParts; ++part)
+        enc.encodeEncrypt(
+            pairs[p].countries[part],
+            packStrings(countries, segmentSlots, he.slotCount(), part));
+      // Similarly encrypt the capital names
+      enc.encodeEncrypt(pairs[p].capitals,
+                        packStrings(capitals, segmentSlots, he.slotCount()));
+    }
+  }
+  // Nothing to load
+  call_once(loadOnce, []() {});
+}
 
-  HELAYERS_TIMER_PUSH("DecryptQueryResult");
-  vector<int> res = enc.decryptDecodeInt(value);
-  HELAYERS_TIMER_POP();
+EncryptedDb::EncryptedDb(HeContext& he, const string& path)
+    : he(he), path(path)
+{
+  ifstream in(path, ios::in | ios::binary);
+  if (!in.is_open())
+    throw runtime_error("Failed to open " + path);
+  readHeader(in);
+  dataOffset = in.tellg();
+}
 
-  // Convert from ASCII to a string
-  string string_result;
-  for (long i = 0; i < res.size(); ++i)
-    string_result.push_back(static_cast<long>(res[i]));
+template <typename T>
+static void writeValue(ostream& out, const T& val)
+{
+  out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
 
-  HELAYERS_TIMER_POP();
+template <typename T>
+static T readValue(istream& in)
+{
+  T val;
+  in.read(reinterpret_cast<char*>(&val), sizeof(T));
+  if (!in)
+    throw runtime_error("Truncated index file");
+  return val;
+}
 
-  if (string_result.at(0) == 0x00) {
-    string_result = "Country name not in the database.\n*** Please make sure "
-                    "to enter the name of an European Country\n*** with the "
-                    "first letter in upper case.";
+void EncryptedDb::save(const string& path) const
+{
+  ofstream out(path, ios::out | ios::binary);
+  if (!out.is_open())
+    throw runtime_error("Failed to open " + path);
+  out.write(magic, sizeof(magic));
+  writeValue<uint32_t>(out, version);
+  writeValue<int32_t>(out, plaintextModulus);
+  writeValue<int32_t>(out, he.slotCount());
+  writeValue<int32_t>(out, layout.segmentSlots);
+  writeValue<int64_t>(out, numEntries);
+  writeValue<int64_t>(out, numPairs);
+  writeValue<int32_t>(out, getNumBuckets());
+  for (int b = 0; b < getNumBuckets(); ++b)
+    writeValue<int64_t>(out, bucketBegin[b + 1] - bucketBegin[b]);
+  writeValue<int32_t>(out, layout.keyParts);
+  // Every pair is stored as its country parts followed by its capitals
+  for (const EncryptedPair& encrypted_pair : getPairs()) {
+    vector<const CTile*> ctiles;
+    for (const CTile& c : encrypted_pair.countries)
+      ctiles.push_back(&c);
+    ctiles.push_back(&encrypted_pair.capitals);
+    for (const CTile* c : ctiles) {
+      stringstream ss;
+      c->save(ss);
+      string bytes = ss.str();
+      writeValue<uint64_t>(out, bytes.size());
+      out.write(bytes.data(), bytes.size());
+    }
+  }
+  if (!out)
+    throw runtime_error("Failed to write " + path);
+}
+
+void EncryptedDb::readHeader(istream& in)
+{
+  char fileMagic[sizeof(magic)];
+  in.read(fileMagic, sizeof(fileMagic));
+  if (!in || memcmp(fileMagic, magic, sizeof(magic)) != 0)
+    throw runtime_error(path + " is not an index file");
+  if (readValue<uint32_t>(in) != version)
+    throw runtime_error("Unsupported index file version in " + path);
+  plaintextModulus = readValue<int32_t>(in);
+  if (readValue<int32_t>(in) != he.slotCount())
+    throw runtime_error(path + " was built with a different slot count");
+  layout.segmentSlots = readValue<int32_t>(in);
+  if (layout.segmentSlots < 1 || he.slotCount() % layout.segmentSlots != 0)
+    throw runtime_error("Corrupted index file " + path);
+  numEntries = readValue<int64_t>(in);
+  numPairs = readValue<int64_t>(in);
+  int numBuckets = readValue<int32_t>(in);
+  if (numBuckets < 1)
+    throw runtime_error("Corrupted index file " + path);
+  bucketBegin.assign(1, 0);
+  for (int b = 0; b < numBuckets; ++b)
+    bucketBegin.push_back(bucketBegin.back() + readValue<int64_t>(in));
+  if (bucketBegin.back() != numPairs)
+    throw runtime_error("Corrupted index file " + path);
+  layout.keyParts = readValue<int32_t>(in);
+  if (layout.keyParts < 1)
+    throw runtime_error("Corrupted index file " + path);
+}
+
+const vector<EncryptedPair>& EncryptedDb::getPairs() const
+{
+  call_once(loadOnce, [this]() { load(); });
+  return pairs;
+}
+
+void EncryptedDb::load() const
+{
+  HELAYERS_TIMER("LoadDB");
+  // The file is read sequentially, and the ciphertexts are then
+  // deserialized in parallel
+  ifstream in(path, ios::in | ios::binary);
+  in.seekg(dataOffset);
+  int ctilesPerPair = layout.keyParts + 1;
+  vector<string> blobs(ctilesPerPair * numPairs);
+  for (string& blob : blobs) {
+    blob.resize(readValue<uint64_t>(in));
+    in.read(&blob[0], blob.size());
+    if (!in)
+      throw runtime_error("Truncated index file " + path);
+  }
+
+  pairs.assign(numPairs, EncryptedPair(he, layout.keyParts));
+#pragma omp parallel for
+  for (int i = 0; i < (int)blobs.size(); ++i) {
+    istringstream ss(blobs[i]);
+    EncryptedPair& encrypted_pair = pairs[i / ctilesPerPair];
+    int part = i % ctilesPerPair;
+    CTile& c = part < layout.keyParts ? encrypted_pair.countries[part]
+                                      : encrypted_pair.capitals;
+    c.load(ss);
   }
-  if (debug)
-    HELAYERS_TIMER_PRINT_MEASURES_SUMMARY_FLAT();
-  cout << "\nQuery result: " << string_result << endl;
 }
 
 // Utility function to read <K,V> CSV data from file
-vector<pair<string, string>> read_csv(const string& filename, int maxLen)
+vector<pair<string, string>> read_csv(const string& filename)
 {
   vector<pair<string, string>> dataset;
   ifstream data_file =
@@ -369,11 +1402,6 @@ vector<pair<string, string>> read_csv(const string& filename, int maxLen)
       while (getline(ss, entry, ',')) {
         row.push_back(entry);
       }
-      if (row[0].size() > maxLen)
-        throw runtime_error("Country name " + row[0] + " too long");
-      if (row[1].size() > maxLen)
-        throw runtime_error("Capital name " + row[1] + " too long");
-
       // Add key value pairs to dataset
       dataset.push_back(make_pair(row[0], row[1]));
     }
@@ -383,6 +1411,30 @@ vector<pair<string, string>> read_csv(const string& filename, int maxLen)
   return dataset;
 }
 
+// Choose the segment size for the database: its longest name rounded up to
+// a power of 2, but at most a whole ciphertext. Countries that don't fit in
+// a segment then span several parts. A capital has to fit in a segment.
+SegmentLayout chooseLayout(const vector<pair<string, string>>& country_db,
+                           int numSlots)
+{
+  int maxCountry = 1;
+  int maxCapital = 1;
+  for (const auto& entry : country_db) {
+    if ((int)entry.second.size() > numSlots)
+      throw runtime_error("Capital name " + entry.second + " too long");
+    maxCountry = max(maxCountry, (int)entry.first.size());
+    maxCapital = max(maxCapital, (int)entry.second.size());
+  }
+
+  SegmentLayout layout;
+  while (layout.segmentSlots < numSlots &&
+         (layout.segmentSlots < maxCountry || layout.segmentSlots < maxCapital))
+    layout.segmentSlots *= 2;
+  layout.keyParts =
+      (maxCountry + layout.segmentSlots - 1) / layout.segmentSlots;
+  return layout;
+}
+
 // Return a vector of ints with the i'th element containing the ascii
 // code of the i'th character
 vector<int> stringToAscii(const string& val)
@@ -394,3 +1446,23 @@ vector<int> stringToAscii(const string& val)
   }
   return res;
 }
+
+// Return the ascii codes of the strings, the i'th string starting at slot
+// i * segmentSlots, padded with zeros to numSlots slots. Only the given part
+// of every string is packed: its characters from part * segmentSlots on.
+vector<int> packStrings(const vector<string>& vals,
+                        int segmentSlots,
+                        int numSlots,
+                        int part)
+{
+  vector<int> res(numSlots, 0);
+  size_t start = (size_t)part * segmentSlots;
+  for (size_t i = 0; i < vals.size(); ++i) {
+    if (vals[i].size() <= start)
+      continue;
+    vector<int> ascii = stringToAscii(vals[i].substr(start, segmentSlots));
+    for (size_t j = 0; j < ascii.size(); ++j)
+      res[i * segmentSlots + j] = ascii[j];
+  }
+  return res;
+}
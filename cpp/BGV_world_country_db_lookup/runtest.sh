@@ -27,13 +27,20 @@ country_capitals=('Australia:Canberra' 'Albania:Tirana' 'Austria:Vienna' 'Belaru
 # Number of queries
 rc=${#country_capitals[@]}
 
+# All the queries are answered by a single server process, so the HE context
+# and the database are only initialized once
+queries=""
+for country_capital in "${country_capitals[@]}"; do
+  queries+="${country_capital%:*}"$'\n'
+done
+results=$( $PWD/BGV_world_country_db_lookup --server <<< "$queries" )
+
 for country_capital in "${country_capitals[@]}"; do
   # Capture the result value for comparison
   query="${country_capital%:*}"
-  
+
   echo "Looking up $query . . . "
-  echo $query
-  capital=$( $PWD/BGV_world_country_db_lookup <<< $query | awk '/Query result:/{ print $3 }' )
+  capital=$( echo "$results" | sed -n "s/^Query result for $query: \([^ ]*\).*/\1/p" )
 
   echo "    . . .  capital is '$capital'"
   if [ "$capital" = "${country_capital#*:}" ]; then 
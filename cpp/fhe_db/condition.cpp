@@ -0,0 +1,111 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <functional>
+#include <queue>
+
+#include "condition.h"
+
+using namespace std;
+using namespace helayers;
+
+Condition::Condition(const Predicate& predicate)
+    : op(COND_PREDICATE), predicate(make_shared<Predicate>(predicate))
+{
+}
+
+Condition::Condition(ConditionOp op, const vector<Condition>& children)
+    : op(op), children(children)
+{
+  if (children.empty())
+    throw runtime_error("A compound condition must have operands");
+}
+
+Condition Condition::allOf(const vector<Condition>& conditions)
+{
+  return Condition(COND_AND, conditions);
+}
+
+Condition Condition::anyOf(const vector<Condition>& conditions)
+{
+  return Condition(COND_OR, conditions);
+}
+
+Condition Condition::negate(const Condition& condition)
+{
+  return Condition(COND_NOT, {condition});
+}
+
+Condition Condition::between(const string& column,
+                             const CTile& low,
+                             const CTile& high)
+{
+  return allOf({Predicate{column, IS_GREATER_EQUAL, low},
+                Predicate{column, IS_SMALLER_EQUAL, high}});
+}
+
+const Predicate& Condition::getPredicate() const
+{
+  if (op != COND_PREDICATE)
+    throw runtime_error("Not a predicate condition");
+  return *predicate;
+}
+
+void Condition::getPredicates(vector<const Predicate*>& res) const
+{
+  if (op == COND_PREDICATE)
+    res.push_back(predicate.get());
+  for (const Condition& child : children)
+    child.getPredicates(res);
+}
+
+int Condition::getCombineDepth() const
+{
+  switch (op) {
+  case COND_PREDICATE:
+    return 0;
+  case COND_NOT:
+    return children[0].getCombineDepth();
+  default: {
+    priority_queue<int, vector<int>, greater<int>> depths;
+    for (const Condition& child : children)
+      depths.push(child.getCombineDepth());
+    while (depths.size() > 1) {
+      depths.pop();
+      int deeper = depths.top();
+      depths.pop();
+      depths.push(deeper + 1);
+    }
+    return depths.top();
+  }
+  }
+}
+
+int Condition::getCombineMultiplications() const
+{
+  int res = op == COND_AND || op == COND_OR ? children.size() - 1 : 0;
+  for (const Condition& child : children)
+    res += child.getCombineMultiplications();
+  return res;
+}
@@ -0,0 +1,99 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CONDITION_H_
+#define CONDITION_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "helayers/hebase/hebase.h"
+#include "helayers/db/Table.h"
+
+/// A "<column> <comparisonType> <compareValue>" clause. The compare value is
+/// encrypted by EncryptedTable::createCompareValue().
+struct Predicate
+{
+  std::string column;
+  helayers::ComparisonType comparisonType;
+  helayers::CTile compareValue;
+};
+
+enum ConditionOp
+{
+  COND_PREDICATE,
+  COND_AND,
+  COND_OR,
+  COND_NOT
+};
+
+/// A WHERE clause: either a single predicate, or an AND, OR or NOT of other
+/// conditions. Masks are combined homomorphically: AND multiplies them, OR
+/// computes 1-(1-a)(1-b) and NOT computes 1-a.
+class Condition
+{
+public:
+  /// A condition of a single predicate.
+  Condition(const Predicate& predicate);
+
+  static Condition allOf(const std::vector<Condition>& conditions);
+
+  static Condition anyOf(const std::vector<Condition>& conditions);
+
+  static Condition negate(const Condition& condition);
+
+  /// "<column> BETWEEN <low> AND <high>", where both ends are included.
+  static Condition between(const std::string& column,
+                           const helayers::CTile& low,
+                           const helayers::CTile& high);
+
+  ConditionOp getOp() const { return op; }
+
+  const Predicate& getPredicate() const;
+
+  const std::vector<Condition>& getChildren() const { return children; }
+
+  /// Appends the predicates of the condition to res, in evaluation order.
+  void getPredicates(std::vector<const Predicate*>& res) const;
+
+  /// Returns the multiplication depth that combining the predicates' masks
+  /// adds on top of the deepest predicate. AND and OR of n conditions are
+  /// combined in a tree that always multiplies the two shallowest operands
+  /// first, so n predicates of the same depth add ceil(log2(n)) levels.
+  int getCombineDepth() const;
+
+  /// Returns the number of ciphertext multiplications that combining the
+  /// predicates' masks takes: n-1 for an AND or OR of n conditions.
+  int getCombineMultiplications() const;
+
+private:
+  Condition(ConditionOp op, const std::vector<Condition>& children);
+
+  ConditionOp op;
+  std::shared_ptr<const Predicate> predicate;
+  std::vector<Condition> children;
+};
+
+#endif
@@ -0,0 +1,1056 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <omp.h>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+const vector<double>& PlainTable::getColumn(const string& name) const
+{
+  for (size_t i = 0; i < columnNames.size(); ++i)
+    if (columnNames[i] == name)
+      return columns[i];
+  throw runtime_error("Unknown column " + name);
+}
+
+static vector<string> readCsvHeader(istream& in)
+{
+  string line, entry;
+  if (!getline(in, line))
+    throw runtime_error("Empty CSV table");
+  vector<string> columnNames;
+  stringstream header(line);
+  while (getline(header, entry, ','))
+    columnNames.push_back(entry);
+  return columnNames;
+}
+
+// Reads the next non-empty line into line. Returns false at the end of the
+// input.
+static bool readCsvLine(istream& in, string& line)
+{
+  do {
+    if (!getline(in, line))
+      return false;
+  } while (line.empty());
+  return true;
+}
+
+static void parseCsvRow(const string& line, size_t numCols, vector<double>& row)
+{
+  string entry;
+  row.clear();
+  stringstream ss(line);
+  while (getline(ss, entry, ',')) {
+    if (row.size() >= numCols)
+      throw runtime_error("Too many values in CSV row: " + line);
+    row.push_back(stod(entry));
+  }
+  if (row.size() != numCols)
+    throw runtime_error("Too few values in CSV row: " + line);
+}
+
+// Reads the next non-empty row into row. Returns false at the end of the
+// input.
+static bool readCsvRow(istream& in, size_t numCols, vector<double>& row)
+{
+  string line;
+  if (!readCsvLine(in, line))
+    return false;
+  parseCsvRow(line, numCols, row);
+  return true;
+}
+
+PlainTable readCsvTable(istream& in)
+{
+  PlainTable table;
+  table.columnNames = readCsvHeader(in);
+  table.columns.resize(table.columnNames.size());
+
+  vector<double> row;
+  while (readCsvRow(in, table.columns.size(), row))
+    for (size_t c = 0; c < row.size(); ++c)
+      table.columns[c].push_back(row[c]);
+
+  return table;
+}
+
+namespace {
+
+// A block of consecutive chunks of all columns, in the clear.
+struct RowBlock
+{
+  int firstChunk = 0;
+  int numChunks = 0;
+  std::vector<std::vector<double>> columns;
+};
+
+// A bounded queue of row blocks, passed from the CSV reader thread to the
+// encrypting threads.
+class RowBlockQueue
+{
+public:
+  explicit RowBlockQueue(size_t capacity) : capacity(capacity) {}
+
+  // Returns false if the queue was closed.
+  bool push(RowBlock&& block)
+  {
+    unique_lock<mutex> lock(mtx);
+    notFull.wait(lock, [&] { return closed || blocks.size() < capacity; });
+    if (closed)
+      return false;
+    blocks.push_back(move(block));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Returns false once the queue is closed and empty.
+  bool pop(RowBlock& block)
+  {
+    unique_lock<mutex> lock(mtx);
+    notEmpty.wait(lock, [&] { return closed || !blocks.empty(); });
+    if (blocks.empty())
+      return false;
+    block = move(blocks.front());
+    blocks.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    lock_guard<mutex> lock(mtx);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed = false;
+  deque<RowBlock> blocks;
+  mutex mtx;
+  condition_variable notEmpty;
+  condition_variable notFull;
+};
+
+} // namespace
+
+EncryptedTable::EncryptedTable(HeContext& he,
+                               const vector<string>& columnNames,
+                               const CompareConfig& compareConfig)
+    : he(he),
+      enc(he),
+      fe(he),
+      compareConfig(compareConfig),
+      numSlots(he.slotCount()),
+      numRows(0),
+      numChunks(0),
+      columnNames(columnNames)
+{
+}
+
+EncryptedTable::EncryptedTable(HeContext& he,
+                               const PlainTable& table,
+                               const CompareConfig& compareConfig)
+    : EncryptedTable(he, table.columnNames, compareConfig)
+{
+  int rows = table.columns.empty() ? 0 : table.columns[0].size();
+  vector<Column> stats(columnNames.size());
+  for (size_t c = 0; c < columnNames.size(); ++c) {
+    if ((int)table.columns[c].size() != rows)
+      throw runtime_error("Column " + columnNames[c] +
+                          " has a different number of rows");
+    for (double v : table.columns[c])
+      updateStats(stats[c], v);
+  }
+  initLayout(rows, stats);
+
+  int numCols = columnNames.size();
+#pragma omp parallel for
+  for (int i = 0; i < numCols * numChunks; ++i) {
+    int c = i / numChunks;
+    int chunk = i % numChunks;
+    int first = chunk * numSlots;
+    encryptChunk(c,
+                 chunk,
+                 table.columns[c].data() + first,
+                 min(numSlots, numRows - first));
+  }
+}
+
+EncryptedTable::EncryptedTable(HeContext& he,
+                               istream& csv,
+                               const CompareConfig& compareConfig,
+                               int blockRows)
+    : EncryptedTable(he, readCsvHeader(csv), compareConfig)
+{
+  size_t numCols = columnNames.size();
+
+  // A first pass over the input finds the number of rows and the range of
+  // every column, which fix the layout and scale of the table. The lines
+  // are read in blocks of blockRows, and the rows of a block are parsed by
+  // OpenMP threads, so this pass also keeps only a block in memory.
+  streampos dataStart = csv.tellg();
+  vector<Column> stats(numCols);
+  int rows = 0;
+  vector<string> lines;
+  vector<vector<double>> parsed;
+  string line;
+  while (csv) {
+    lines.clear();
+    while ((int)lines.size() < max(blockRows, 1) && readCsvLine(csv, line))
+      lines.push_back(move(line));
+    int blockSize = lines.size();
+    parsed.resize(blockSize);
+    exception_ptr parseError;
+#pragma omp parallel for
+    for (int r = 0; r < blockSize; ++r) {
+      try {
+        parseCsvRow(lines[r], numCols, parsed[r]);
+      } catch (...) {
+#pragma omp critical
+        parseError = current_exception();
+      }
+    }
+    if (parseError)
+      rethrow_exception(parseError);
+#pragma omp parallel for
+    for (size_t c = 0; c < numCols; ++c)
+      for (int r = 0; r < blockSize; ++r)
+        updateStats(stats[c], parsed[r][c]);
+    rows += blockSize;
+  }
+  csv.clear();
+  csv.seekg(dataStart);
+  if (!csv)
+    throw runtime_error("Streaming table ingestion requires a seekable input");
+  initLayout(rows, stats);
+
+  // The reader thread parses blocks of whole chunks, while the encryption
+  // of each block is split between OpenMP threads. The bounded queue keeps
+  // at most a few blocks in memory at a time. Every chunk has a
+  // preallocated position, so the blocks are written in order.
+  int blockChunks = max(1, blockRows / numSlots);
+  RowBlockQueue queue(2);
+  exception_ptr readerError;
+
+  thread reader([&]() {
+    try {
+      vector<double> row;
+      for (int first = 0; first < numChunks; first += blockChunks) {
+        RowBlock block;
+        block.firstChunk = first;
+        block.numChunks = min(blockChunks, numChunks - first);
+        // Slots past the last row are left as zeros
+        block.columns.assign(numCols,
+                             vector<double>(block.numChunks * numSlots, 0));
+        int blockSize =
+            min(block.numChunks * numSlots, numRows - first * numSlots);
+        for (int r = 0; r < blockSize; ++r) {
+          if (!readCsvRow(csv, numCols, row))
+            throw runtime_error("CSV table ended unexpectedly");
+          for (size_t c = 0; c < numCols; ++c)
+            block.columns[c][r] = row[c];
+        }
+        if (!queue.push(move(block)))
+          break;
+      }
+    } catch (...) {
+      readerError = current_exception();
+    }
+    queue.close();
+  });
+
+  try {
+    RowBlock block;
+    while (queue.pop(block)) {
+      HELAYERS_TIMER("encrypt row block");
+      int numTasks = numCols * block.numChunks;
+#pragma omp parallel for
+      for (int i = 0; i < numTasks; ++i) {
+        int c = i / block.numChunks;
+        int chunk = i % block.numChunks;
+        encryptChunk(c,
+                     block.firstChunk + chunk,
+                     block.columns[c].data() + chunk * numSlots,
+                     numSlots);
+      }
+    }
+  } catch (...) {
+    queue.close();
+    reader.join();
+    throw;
+  }
+  reader.join();
+  if (readerError)
+    rethrow_exception(readerError);
+}
+
+void EncryptedTable::updateStats(Column& stats, double val)
+{
+  if (stats.scale == 0) {
+    stats.scale = 1;
+    stats.minVal = val;
+    stats.maxVal = val;
+  }
+  stats.scale = max(stats.scale, fabs(val));
+  stats.minVal = min(stats.minVal, val);
+  stats.maxVal = max(stats.maxVal, val);
+}
+
+void EncryptedTable::initLayout(int rows, const vector<Column>& stats)
+{
+  if (rows == 0)
+    throw runtime_error("Cannot encrypt an empty table");
+
+  numRows = rows;
+  numChunks = (numRows + numSlots - 1) / numSlots;
+  initValidity();
+
+  for (size_t c = 0; c < columnNames.size(); ++c) {
+    Column column = stats[c];
+    column.chunks.assign(numChunks, CTile(he));
+    columns.emplace(columnNames[c], move(column));
+  }
+}
+
+void EncryptedTable::initValidity()
+{
+  deleted.resize(numRows, false);
+  validity.clear();
+  for (int chunk = 0; chunk < numChunks; ++chunk)
+    updateValidity(chunk);
+}
+
+void EncryptedTable::updateValidity(int chunk)
+{
+  int first = chunk * numSlots;
+  int last = min(numRows, first + numSlots);
+  bool allValid = last - first == numSlots;
+  vector<double> slots(numSlots, 0);
+  for (int row = first; row < last; ++row) {
+    slots[row - first] = deleted[row] ? 0 : 1;
+    allValid &= !deleted[row];
+  }
+
+  if (allValid) {
+    validity.erase(chunk);
+    return;
+  }
+  PTile p(he);
+  enc.encode(p, slots);
+  validity.insert_or_assign(chunk, p);
+}
+
+const PTile* EncryptedTable::getValidity(int chunk) const
+{
+  auto it = validity.find(chunk);
+  return it == validity.end() ? nullptr : &it->second;
+}
+
+void EncryptedTable::encryptChunk(int col,
+                                  int chunk,
+                                  const double* vals,
+                                  int numVals)
+{
+  Column& column = columns.at(columnNames[col]);
+  // Slots past the last row are left as zeros
+  vector<double> slots(numSlots, 0);
+  for (int i = 0; i < numVals; ++i)
+    slots[i] = vals[i] / column.scale;
+  enc.encodeEncrypt(column.chunks[chunk], slots);
+}
+
+void EncryptedTable::appendToChunk(int col,
+                                   int chunk,
+                                   int firstSlot,
+                                   const double* vals,
+                                   int numVals)
+{
+  Column& column = columns.at(columnNames[col]);
+  vector<double> slots(numSlots, 0);
+  for (int i = 0; i < numVals; ++i)
+    slots[firstSlot + i] = vals[i] / column.scale;
+  CTile added(he);
+  enc.encodeEncrypt(added, slots);
+  column.chunks[chunk].add(added);
+}
+
+void EncryptedTable::appendRows(const PlainTable& rows)
+{
+  HELAYERS_TIMER("append rows");
+  if (rows.columnNames != columnNames)
+    throw runtime_error("Appended rows must have the columns of the table");
+  int numNew = rows.columns.empty() ? 0 : rows.columns[0].size();
+  for (size_t c = 0; c < columnNames.size(); ++c)
+    if ((int)rows.columns[c].size() != numNew)
+      throw runtime_error("Column " + columnNames[c] +
+                          " has a different number of rows");
+  if (numNew == 0)
+    return;
+
+  // The chunks are encrypted divided by the scale of their column, which
+  // keeps them within [-1, 1]. A value beyond the scale would leave that
+  // range, so it requires encrypting the table again.
+  for (size_t c = 0; c < columnNames.size(); ++c) {
+    double scale = getColumn(columnNames[c], false).scale;
+    for (double v : rows.columns[c])
+      if (fabs(v) > scale)
+        throw runtime_error("Value " + to_string(v) + " of column " +
+                            columnNames[c] + " exceeds its scale " +
+                            to_string(scale) +
+                            "; encrypt the table again to append it");
+  }
+
+  // The chunks of a loaded table are modified, so all of them are read first
+  for (size_t c = 0; c < columnNames.size(); ++c) {
+    getColumn(columnNames[c]);
+    Column& column = columns.at(columnNames[c]);
+    for (double v : rows.columns[c]) {
+      column.minVal = min(column.minVal, v);
+      column.maxVal = max(column.maxVal, v);
+    }
+  }
+
+  int oldRows = numRows;
+  int oldChunks = numChunks;
+  numRows += numNew;
+  numChunks = (numRows + numSlots - 1) / numSlots;
+  for (auto& [name, column] : columns)
+    column.chunks.resize(numChunks, CTile(he));
+
+  // Task 0 of every column fills the free slots of the last chunk, and the
+  // other tasks encrypt the new chunks.
+  int tailSlot = oldRows % numSlots;
+  int numTail = tailSlot == 0 ? 0 : min(numSlots - tailSlot, numNew);
+  int numTasks = 1 + numChunks - oldChunks;
+  int numCols = columnNames.size();
+#pragma omp parallel for
+  for (int i = 0; i < numCols * numTasks; ++i) {
+    int c = i / numTasks;
+    int task = i % numTasks;
+    const double* vals = rows.columns[c].data();
+    if (task == 0) {
+      if (numTail > 0)
+        appendToChunk(c, oldChunks - 1, tailSlot, vals, numTail);
+      continue;
+    }
+    int first = numTail + (task - 1) * numSlots;
+    encryptChunk(c,
+                 oldChunks + task - 1,
+                 vals + first,
+                 min(numSlots, numNew - first));
+  }
+
+  deleted.resize(numRows, false);
+  for (int chunk = max(oldChunks - 1, 0); chunk < numChunks; ++chunk)
+    updateValidity(chunk);
+
+  // Cached masks and replicated columns don't cover the new rows
+  maskCache.clear();
+  replicatedColumns.clear();
+}
+
+void EncryptedTable::deleteRows(const vector<int>& rowIndices)
+{
+  set<int> chunks;
+  for (int row : rowIndices) {
+    if (row < 0 || row >= numRows)
+      throw runtime_error("Row " + to_string(row) + " is out of range");
+    if (deleted[row])
+      continue;
+    deleted[row] = true;
+    numDeleted++;
+    chunks.insert(row / numSlots);
+  }
+  for (int chunk : chunks)
+    updateValidity(chunk);
+}
+
+const EncryptedTable::Column& EncryptedTable::getColumn(const string& name,
+                                                        bool load) const
+{
+  auto it = columns.find(name);
+  if (it == columns.end())
+    throw runtime_error("Unknown column " + name);
+  if (load && mappedFile != nullptr) {
+    lock_guard<mutex> lock(loadMutex);
+    if (!it->second.loaded)
+      loadColumn(it->second);
+  }
+  return it->second;
+}
+
+bool EncryptedTable::isColumnLoaded(const string& name) const
+{
+  lock_guard<mutex> lock(loadMutex);
+  return getColumn(name, false).loaded;
+}
+
+CTile EncryptedTable::createCompareValue(double val, const string& column) const
+{
+  const Column& col = getColumn(column, false);
+  // Clamping to one step outside the column's range doesn't change the result
+  // of any comparison, and bounds the difference computeMask() compares.
+  val = min(max(val, col.minVal - 1), col.maxVal + 1);
+  CTile res(he);
+  enc.encodeEncrypt(res, vector<double>(numSlots, val / col.scale));
+  return res;
+}
+
+int EncryptedTable::compareRange(const Column& column)
+{
+  return max(column.maxVal, 0.0) - min(column.minVal, 0.0) + 1;
+}
+
+int EncryptedTable::compareBits(const Column& column)
+{
+  return max(1, (int)ceil(log2(compareRange(column))));
+}
+
+CompareConfig EncryptedTable::columnCompareConfig(const Column& column) const
+{
+  CompareConfig res = compareConfig;
+  // The iterations of g amplify the smallest difference, whose ratio to the
+  // largest one shrinks exponentially with the number of bits
+  if (compareConfig.adaptive)
+    res.gRep = max(1,
+                   (int)ceil((double)compareConfig.gRep * compareBits(column) /
+                             compareConfig.gRepBits));
+  return res;
+}
+
+CompareConfig EncryptedTable::getColumnCompareConfig(const string& name) const
+{
+  return columnCompareConfig(getColumn(name, false));
+}
+
+CTile EncryptedTable::compare(const CTile& a,
+                              const CTile& b,
+                              const Column& column) const
+{
+  double maxDiff = (compareRange(column) + 1) / column.scale;
+  CompareConfig config = columnCompareConfig(column);
+  return fe.compare(a, b, config.gRep, config.fRep, maxDiff);
+}
+
+static size_t serializedSize(const CTile& c)
+{
+  stringstream ss;
+  c.save(ss);
+  return ss.str().size();
+}
+
+void EncryptedTable::accumulate(optional<CTile>& acc, const CTile& val)
+{
+  if (acc.has_value())
+    acc->add(val);
+  else
+    acc = val;
+}
+
+CTile EncryptedTable::computeMask(const Predicate& predicate,
+                                  CompareMethod method,
+                                  int chunk) const
+{
+  const Column& column = getColumn(predicate.column);
+  return compareColumn(column.chunks.at(chunk),
+                       predicate.compareValue,
+                       column,
+                       predicate.comparisonType,
+                       method);
+}
+
+CTile EncryptedTable::compareColumn(const CTile& x,
+                                    const CTile& compareValue,
+                                    const Column& column,
+                                    ComparisonType comparisonType,
+                                    CompareMethod method) const
+{
+  if (method == CMP_INDICATOR)
+    return indicatorMask(x, compareValue, column);
+
+  // The column holds integers divided by its scale, so shifting the compare
+  // value by half a step turns strict and non-strict comparisons into
+  // comparisons that never hit a tie.
+  double halfStep = 0.5 / column.scale;
+  CTile val = compareValue;
+  CTile mask(he);
+
+  switch (comparisonType) {
+  case IS_EQUAL: {
+    // compare() returns 0.5 on a tie and 0 or 1 otherwise, so 4c(1-c) is 1
+    // exactly where x == val.
+    mask = compare(x, val, column);
+    CTile oneMinus = mask;
+    oneMinus.negate();
+    oneMinus.addScalar(1);
+    mask.multiply(oneMinus);
+    mask.multiplyScalar(4);
+    break;
+  }
+  case IS_GREATER:
+    val.addScalar(halfStep);
+    mask = compare(x, val, column);
+    break;
+  case IS_GREATER_EQUAL:
+    val.addScalar(-halfStep);
+    mask = compare(x, val, column);
+    break;
+  case IS_SMALLER:
+    val.addScalar(-halfStep);
+    mask = compare(val, x, column);
+    break;
+  case IS_SMALLER_EQUAL:
+    val.addScalar(halfStep);
+    mask = compare(val, x, column);
+    break;
+  default:
+    throw runtime_error("Unsupported comparison type");
+  }
+
+  return mask;
+}
+
+EncryptedTable::ConditionMasks EncryptedTable::prepareMasks(
+    const Condition& condition) const
+{
+  ConditionMasks masks;
+  condition.getPredicates(masks.predicates);
+  size_t n = masks.predicates.size();
+  masks.methods.resize(n);
+  masks.keys.resize(n);
+  masks.cached.resize(n);
+  masks.computed.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    masks.methods[i] = planPredicate(*masks.predicates[i]).method;
+
+  // A cached mask skips the comparison altogether. Otherwise the computed
+  // mask is kept for the cache, if it is enabled.
+  if (!maskCache.isEnabled())
+    return masks;
+  for (size_t i = 0; i < n; ++i) {
+    const Predicate& pred = *masks.predicates[i];
+    getColumn(pred.column, false);
+    masks.keys[i].emplace(pred.column, pred.comparisonType, pred.compareValue);
+    masks.cached[i] = maskCache.get(*masks.keys[i]);
+    if (masks.cached[i] == nullptr)
+      masks.computed[i] = make_shared<Mask>(numChunks, CTile(he));
+  }
+  return masks;
+}
+
+CTile EncryptedTable::evaluateCondition(const Condition& condition,
+                                        ConditionMasks& masks,
+                                        int chunk) const
+{
+  int n = masks.predicates.size();
+  vector<CTile> predicateMasks(n, CTile(he));
+#pragma omp parallel for if (n > 1)
+  for (int i = 0; i < n; ++i) {
+    if (masks.cached[i] != nullptr)
+      predicateMasks[i] = masks.cached[i]->at(chunk);
+    else
+      predicateMasks[i] =
+          computeMask(*masks.predicates[i], masks.methods[i], chunk);
+    if (masks.computed[i] != nullptr)
+      (*masks.computed[i])[chunk] = predicateMasks[i];
+  }
+
+  size_t next = 0;
+  CTile mask = combineMasks(condition, predicateMasks, next);
+
+  // Deleted rows and padding slots must not match any condition
+  if (const PTile* valid = getValidity(chunk))
+    mask.multiplyPlain(*valid);
+
+  return mask;
+}
+
+CTile EncryptedTable::combineMasks(const Condition& condition,
+                                   vector<CTile>& predicateMasks,
+                                   size_t& next) const
+{
+  switch (condition.getOp()) {
+  case COND_PREDICATE:
+    return move(predicateMasks.at(next++));
+  case COND_NOT: {
+    CTile mask = combineMasks(condition.getChildren()[0], predicateMasks, next);
+    mask.negate();
+    mask.addScalar(1);
+    return mask;
+  }
+  case COND_AND:
+  case COND_OR: {
+    // a OR b = 1 - (1-a)(1-b), so both are a product of the operands, with
+    // OR negating its operands and result.
+    bool isOr = condition.getOp() == COND_OR;
+    vector<CTile> factors;
+    for (const Condition& child : condition.getChildren()) {
+      factors.push_back(combineMasks(child, predicateMasks, next));
+      if (isOr) {
+        factors.back().negate();
+        factors.back().addScalar(1);
+      }
+    }
+    CTile mask = multiplyBalanced(factors);
+    if (isOr) {
+      mask.negate();
+      mask.addScalar(1);
+    }
+    return mask;
+  }
+  default:
+    throw runtime_error("Unsupported condition");
+  }
+}
+
+CTile EncryptedTable::multiplyBalanced(vector<CTile>& factors) const
+{
+  auto shallower = [](const CTile& a, const CTile& b) {
+    return a.getChainIndex() < b.getChainIndex();
+  };
+  while (factors.size() > 1) {
+    // Move the two factors with the highest chain index to the back
+    sort(factors.begin(), factors.end(), shallower);
+    CTile last = move(factors.back());
+    factors.pop_back();
+    factors.back().multiply(last);
+  }
+  return move(factors[0]);
+}
+
+void EncryptedTable::storeMasks(ConditionMasks& masks) const
+{
+  for (size_t i = 0; i < masks.predicates.size(); ++i)
+    if (masks.computed[i] != nullptr)
+      maskCache.put(*masks.keys[i],
+                    masks.computed[i],
+                    serializedSize(masks.computed[i]->front()) * numChunks);
+}
+
+void EncryptedTable::findPartialSums(const vector<Aggregate>& aggregates,
+                                     bool& needCount,
+                                     map<string, bool>& needSumOfSquares) const
+{
+  // COUNT is shared by COUNT, AVG and STDDEV, and the sum of a column by SUM,
+  // AVG and STDDEV of that column.
+  needCount = false;
+  needSumOfSquares.clear();
+  for (const Aggregate& agg : aggregates) {
+    if (agg.type != AGG_SUM)
+      needCount = true;
+    if (agg.type == AGG_COUNT)
+      continue;
+    getColumn(agg.column, false);
+    needSumOfSquares[agg.column] |= (agg.type == AGG_STDDEV);
+  }
+}
+
+void EncryptedTable::PartialSums::add(const PartialSums& other)
+{
+  if (other.count.has_value())
+    accumulate(count, *other.count);
+  for (const auto& [colName, sum] : other.sums)
+    if (sum.has_value())
+      accumulate(sums[colName], *sum);
+  for (const auto& [colName, sumOfSquares] : other.sumsOfSquares)
+    if (sumOfSquares.has_value())
+      accumulate(sumsOfSquares[colName], *sumOfSquares);
+}
+
+void EncryptedTable::reducePartialSums(vector<PartialSums>& partials)
+{
+  int n = partials.size();
+  for (int stride = 1; stride < n; stride *= 2) {
+#pragma omp parallel for if (n > 2 * stride)
+    for (int i = 0; i < n - stride; i += 2 * stride)
+      partials[i].add(partials[i + stride]);
+  }
+}
+
+MultiAggregateResult EncryptedTable::multiAggregateQuery(
+    const Condition& condition,
+    const vector<Aggregate>& aggregates) const
+{
+  // Without bootstrapping, every level of the query has to come from the
+  // depth of a fresh ciphertext
+  if (!he.getAutomaticBootstrapping()) {
+    int depth = planQuery(condition, aggregates).depth;
+    if (depth > he.getTopChainIndex())
+      throw runtime_error("The query needs a multiplication depth of " +
+                          to_string(depth) + ", but the HE context has " +
+                          to_string(he.getTopChainIndex()) +
+                          ". Enable bootstrapping or simplify the condition.");
+  }
+
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(aggregates, needCount, needSumOfSquares);
+
+  ConditionMasks masks = prepareMasks(condition);
+
+  // Load the columns up front, so that the threads below only read them
+  for (const Predicate* pred : masks.predicates)
+    getColumn(pred->column);
+  for (const auto& [colName, withSquares] : needSumOfSquares)
+    getColumn(colName);
+
+  // Every thread accumulates the partial sums of a contiguous range of
+  // chunks, and the partial sums of the threads are then added in a tree.
+  int numThreads = max(1, min(numChunks, omp_get_max_threads()));
+  vector<PartialSums> partials(numThreads);
+
+#pragma omp parallel num_threads(numThreads)
+  {
+    HELAYERS_TIMER("query thread");
+    PartialSums& partial = partials[omp_get_thread_num()];
+
+#pragma omp for schedule(static)
+    for (int chunk = 0; chunk < numChunks; ++chunk) {
+      CTile mask = evaluateCondition(condition, masks, chunk);
+
+      if (needCount)
+        accumulate(partial.count, mask);
+
+      for (const auto& [colName, withSquares] : needSumOfSquares) {
+        const CTile& x = getColumn(colName).chunks[chunk];
+        CTile masked = mask;
+        masked.multiply(x);
+        accumulate(partial.sums[colName], masked);
+        if (withSquares) {
+          masked.multiply(x);
+          accumulate(partial.sumsOfSquares[colName], masked);
+        }
+      }
+    }
+  }
+
+  {
+    HELAYERS_TIMER("query reduction");
+    reducePartialSums(partials);
+  }
+
+  storeMasks(masks);
+
+  PartialSums& total = partials[0];
+  MultiAggregateResult res;
+  res.aggregates = aggregates;
+  res.count = move(total.count);
+  for (auto& [colName, sum] : total.sums)
+    res.sums.emplace(colName, move(*sum));
+  for (auto& [colName, sumOfSquares] : total.sumsOfSquares)
+    res.sumsOfSquares.emplace(colName, move(*sumOfSquares));
+  return res;
+}
+
+double EncryptedTable::sumSlots(const CTile& c) const
+{
+  vector<double> vals = enc.decryptDecodeDouble(c);
+  double sum = 0;
+  for (double v : vals)
+    sum += v;
+  return sum;
+}
+
+CTile EncryptedTable::packSums(const vector<CTile>& vals, int firstSlot) const
+{
+  int n = vals.size();
+  always_assert(n > 0 && firstSlot + n <= numSlots);
+  int packed = 1;
+  while (packed < n)
+    packed *= 2;
+
+  // Pairs of ciphertexts are folded together: with stride h, the slots whose
+  // index modulo 2h is below h keep the partial sums of the first of the
+  // pair, and the other slots those of the second. After log(packed) folds,
+  // every slot i holds a partial sum of vals[i % packed].
+  vector<optional<CTile>> level(packed);
+  for (int i = 0; i < n; ++i) {
+    level[i] = vals[i];
+    level[i]->multiplyScalar(1.0 / numRows);
+  }
+  for (int h = 1; h < packed; h *= 2) {
+    vector<double> low(numSlots), high(numSlots);
+    for (int j = 0; j < numSlots; ++j) {
+      low[j] = j % (2 * h) < h ? 1 : 0;
+      high[j] = 1 - low[j];
+    }
+    PTile lowPlain(he), highPlain(he);
+    enc.encode(lowPlain, low);
+    enc.encode(highPlain, high);
+
+    vector<optional<CTile>> next(level.size() / 2);
+#pragma omp parallel for
+    for (size_t k = 0; k < next.size(); ++k) {
+      const optional<CTile>& first = level[2 * k];
+      const optional<CTile>& second = level[2 * k + 1];
+      if (!first.has_value())
+        continue;
+      // kept = first * low + second * high, moved = first * high +
+      // second * low, and kept + moved rotated by h folds both
+      CTile kept = *first;
+      kept.multiplyPlain(lowPlain);
+      CTile moved = *first;
+      moved.multiplyPlain(highPlain);
+      if (second.has_value()) {
+        CTile tmp = *second;
+        tmp.multiplyPlain(highPlain);
+        kept.add(tmp);
+        tmp = *second;
+        tmp.multiplyPlain(lowPlain);
+        moved.add(tmp);
+      }
+      moved.rotate(h);
+      kept.add(moved);
+      next[k] = kept;
+    }
+    level = move(next);
+  }
+
+  CTile res = *level[0];
+  for (int rot = packed; rot < numSlots; rot *= 2) {
+    CTile tmp = res;
+    tmp.rotate(rot);
+    res.add(tmp);
+  }
+  vector<double> first(numSlots, 0);
+  for (int i = 0; i < n; ++i)
+    first[i] = 1;
+  PTile firstPlain(he);
+  enc.encode(firstPlain, first);
+  res.multiplyPlain(firstPlain);
+  if (firstSlot > 0)
+    res.rotate(-firstSlot);
+  return res;
+}
+
+vector<vector<double>> EncryptedTable::unpackAggregates(
+    const vector<Aggregate>& aggregates,
+    const optional<CTile>& counts,
+    const map<string, CTile>& sums,
+    const map<string, CTile>& sumsOfSquares,
+    int numResults,
+    int stride) const
+{
+  vector<double> countSlots;
+  if (counts.has_value())
+    countSlots = enc.decryptDecodeDouble(*counts);
+  map<string, vector<double>> sumSlots;
+  map<string, vector<double>> sumOfSquaresSlots;
+  for (const auto& [colName, sum] : sums)
+    sumSlots[colName] = enc.decryptDecodeDouble(sum);
+  for (const auto& [colName, sumOfSquares] : sumsOfSquares)
+    sumOfSquaresSlots[colName] = enc.decryptDecodeDouble(sumOfSquares);
+
+  vector<vector<double>> vals;
+  for (int i = 0; i < numResults; ++i) {
+    int slot = i * stride;
+    double count = countSlots.empty() ? 0 : countSlots[slot] * numRows;
+    map<string, double> resSums;
+    map<string, double> resSumsOfSquares;
+    for (const auto& [colName, slots] : sumSlots) {
+      double scale = getColumn(colName, false).scale;
+      resSums[colName] = slots[slot] * numRows * scale;
+    }
+    for (const auto& [colName, slots] : sumOfSquaresSlots) {
+      double scale = getColumn(colName, false).scale;
+      resSumsOfSquares[colName] = slots[slot] * numRows * scale * scale;
+    }
+    vals.push_back(
+        deriveAggregates(aggregates, count, resSums, resSumsOfSquares));
+  }
+  return vals;
+}
+
+void EncryptedTable::rotateAndSum(CTile& c, int numSummed) const
+{
+  for (int rot = 1; rot < numSummed; rot *= 2) {
+    CTile tmp = c;
+    tmp.rotate(rot);
+    c.add(tmp);
+  }
+}
+
+vector<double> EncryptedTable::postProcessMultiAggregateQuery(
+    const MultiAggregateResult& res) const
+{
+  double count = res.count.has_value() ? sumSlots(*res.count) : 0;
+  map<string, double> sums;
+  map<string, double> sumsOfSquares;
+  for (const auto& [colName, sum] : res.sums) {
+    double scale = getColumn(colName, false).scale;
+    sums[colName] = sumSlots(sum) * scale;
+  }
+  for (const auto& [colName, sumOfSquares] : res.sumsOfSquares) {
+    double scale = getColumn(colName, false).scale;
+    sumsOfSquares[colName] = sumSlots(sumOfSquares) * scale * scale;
+  }
+  return deriveAggregates(res.aggregates, count, sums, sumsOfSquares);
+}
+
+vector<double> EncryptedTable::deriveAggregates(
+    const vector<Aggregate>& aggregates,
+    double count,
+    const map<string, double>& sums,
+    const map<string, double>& sumsOfSquares)
+{
+  vector<double> vals;
+  vals.reserve(aggregates.size());
+  for (const Aggregate& agg : aggregates) {
+    switch (agg.type) {
+    case AGG_COUNT:
+      vals.push_back(count);
+      break;
+    case AGG_SUM:
+      vals.push_back(sums.at(agg.column));
+      break;
+    case AGG_AVG:
+      vals.push_back(sums.at(agg.column) / count);
+      break;
+    case AGG_STDDEV: {
+      double avg = sums.at(agg.column) / count;
+      double variance = sumsOfSquares.at(agg.column) / count - avg * avg;
+      vals.push_back(sqrt(max(variance, 0.0)));
+      break;
+    }
+    default:
+      throw runtime_error("Unsupported aggregate type");
+    }
+  }
+  return vals;
+}
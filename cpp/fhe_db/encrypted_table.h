@@ -0,0 +1,658 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ENCRYPTED_TABLE_H_
+#define ENCRYPTED_TABLE_H_
+
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "helayers/hebase/hebase.h"
+#include "helayers/math/FunctionEvaluator.h"
+#include "helayers/db/Table.h"
+#include "condition.h"
+#include "mask_cache.h"
+#include "query_plan.h"
+
+/// A table in the clear, stored column by column.
+struct PlainTable
+{
+  std::vector<std::string> columnNames;
+  std::vector<std::vector<double>> columns;
+
+  const std::vector<double>& getColumn(const std::string& name) const;
+};
+
+/// Reads a CSV file with a header line of column names followed by rows of
+/// numeric values.
+PlainTable readCsvTable(std::istream& in);
+
+enum AggregateType
+{
+  AGG_COUNT,
+  AGG_SUM,
+  AGG_AVG,
+  AGG_STDDEV
+};
+
+/// A single aggregate of a query. The column is ignored for AGG_COUNT.
+struct Aggregate
+{
+  AggregateType type;
+  std::string column;
+};
+
+/// The encrypted result of EncryptedTable::multiAggregateQuery(). It holds
+/// per-slot partial sums, each computed once no matter how many of the
+/// requested aggregates depend on it.
+struct MultiAggregateResult
+{
+  std::vector<Aggregate> aggregates;
+  std::optional<helayers::CTile> count;
+  std::map<std::string, helayers::CTile> sums;
+  std::map<std::string, helayers::CTile> sumsOfSquares;
+};
+
+/// The encrypted result of EncryptedTable::groupByQuery(). Every partial sum
+/// is packed in a single CTile, whose slot g holds the partial sum of the g-th
+/// group key divided by the number of rows of the table.
+struct GroupByResult
+{
+  std::vector<int> keys;
+  std::vector<Aggregate> aggregates;
+  std::optional<helayers::CTile> counts;
+  std::map<std::string, helayers::CTile> sums;
+  std::map<std::string, helayers::CTile> sumsOfSquares;
+};
+
+/// The encrypted result of EncryptedTable::batchQuery(). Every partial sum is
+/// packed in a single CTile, whose slot b * stride holds the partial sum of
+/// the b-th query of the batch divided by the number of rows of the table.
+struct BatchQueryResult
+{
+  int batchSize = 0;
+  int stride = 1;
+  std::vector<Aggregate> aggregates;
+  std::optional<helayers::CTile> counts;
+  std::map<std::string, helayers::CTile> sums;
+  std::map<std::string, helayers::CTile> sumsOfSquares;
+};
+
+/// The encrypted result of EncryptedTable::sampledQuery(). The server visits
+/// the chunks in a random order. The partial sums of the i-th chunk visited
+/// are packed in slot i, divided by the number of rows of the table.
+struct SampledQueryResult
+{
+  std::optional<Condition> condition;
+  std::vector<Aggregate> aggregates;
+  std::vector<int> chunkOrder;
+  int numSampled = 0;
+  std::optional<helayers::CTile> counts;
+  std::map<std::string, helayers::CTile> sums;
+  std::map<std::string, helayers::CTile> sumsOfSquares;
+};
+
+/// An estimate of an aggregate, with a confidence interval.
+struct ApproximateAggregate
+{
+  double estimate;
+  double low;
+  double high;
+};
+
+/// The encrypted result of EncryptedTable::histogramQuery(): the number of
+/// rows below every bucket boundary, as a batch of COUNT queries.
+struct HistogramResult
+{
+  std::string column;
+  std::vector<int> boundaries;
+  BatchQueryResult belowBoundaries;
+};
+
+/// The encrypted result of EncryptedTable::topKQuery(): the i-th largest (or
+/// smallest) value of the column, in every slot of values[i].
+struct TopKResult
+{
+  std::string column;
+  bool largest = true;
+  std::vector<helayers::CTile> values;
+};
+
+/// Accuracy parameters of the encrypted comparison, see
+/// FunctionEvaluator::compare(). gRep is tuned for columns of gRepBits bits.
+/// When adaptive, every column is compared with gRep scaled by the bit width
+/// of its range, so narrow columns get a shallower comparison and wide ones
+/// a more accurate one.
+struct CompareConfig
+{
+  int gRep = 4;
+  int fRep = 1;
+  int gRepBits = 11;
+  bool adaptive = true;
+};
+
+/// A columnar encrypted table. Every column is split into chunks of
+/// slotCount() rows, each chunk encrypted in a single CTile. Values are
+/// normalized by a per-column scale so that they lie in [-1, 1], and scaled
+/// back during post processing. Columns used in predicates must hold
+/// integers.
+class MappedFile;
+
+class EncryptedTable
+{
+public:
+  EncryptedTable(helayers::HeContext& he,
+                 const PlainTable& table,
+                 const CompareConfig& compareConfig = CompareConfig());
+
+  /// Encrypts a CSV table as it is read. A reader thread parses blocks of
+  /// blockRows rows (rounded down to whole chunks) while OpenMP threads
+  /// encrypt the previous block, so only a few blocks are held in memory at
+  /// a time. The input must be seekable, since the range of every column is
+  /// found in a first pass, which parses blocks of the same size in
+  /// parallel.
+  EncryptedTable(helayers::HeContext& he,
+                 std::istream& csv,
+                 const CompareConfig& compareConfig = CompareConfig(),
+                 int blockRows = 1 << 17);
+
+  /// Saves the table in a columnar format: a header with the slot layout,
+  /// the signature of the HE context and the range of every column, followed
+  /// by one segment per column chunk.
+  void saveToFile(const std::string& path) const;
+
+  /// Memory-maps a table saved by saveToFile(). Columns are read from the
+  /// mapping on first use, so queries only pay for the columns they touch.
+  /// Throws if the table was saved under a different HE context
+  /// configuration.
+  static std::unique_ptr<EncryptedTable> loadFromFile(
+      helayers::HeContext& he,
+      const std::string& path,
+      const CompareConfig& compareConfig = CompareConfig());
+
+  /// Appends rows with the columns of the table, in the same order. The
+  /// first rows fill the free slots of the last chunk, and are added to it
+  /// homomorphically, and the rest are encrypted in new chunks, so the cost is
+  /// proportional to the number of new rows. Columns keep their scale, so a
+  /// value whose magnitude exceeds the scale of its column would be encrypted
+  /// outside [-1, 1]; such rows are rejected with an exception before any
+  /// change. The mask cache is cleared. Must not run concurrently with
+  /// queries.
+  void appendRows(const PlainTable& rows);
+
+  /// Marks rows as deleted. Deleted rows are left in their chunks, but the
+  /// validity of their slots, which every query multiplies its mask by, is
+  /// zeroed. Must not run concurrently with queries.
+  void deleteRows(const std::vector<int>& rowIndices);
+
+  bool isRowDeleted(int row) const { return deleted.at(row); }
+
+  int getNumDeletedRows() const { return numDeleted; }
+
+  /// Returns false for a column of a loaded table that was not used yet.
+  bool isColumnLoaded(const std::string& name) const;
+
+  /// Returns the comparison parameters used for the given column.
+  CompareConfig getColumnCompareConfig(const std::string& name) const;
+
+  int getNumRows() const { return numRows; }
+
+  int getNumChunks() const { return numChunks; }
+
+  const std::vector<std::string>& getColumnNames() const
+  {
+    return columnNames;
+  }
+
+  /// Encrypts a value to compare against the given column.
+  helayers::CTile createCompareValue(double val,
+                                     const std::string& column) const;
+
+  /// Evaluates the condition once per chunk and derives all the requested
+  /// aggregates from the resulting mask. The chunks are split between
+  /// OpenMP threads, each accumulating its own partial sums, and the partial
+  /// sums of the threads are added in a tree. Unless the HE context
+  /// bootstraps automatically, throws if the planned depth of the query,
+  /// including the combination of a compound condition, exceeds the depth of
+  /// the context.
+  MultiAggregateResult multiAggregateQuery(
+      const Condition& condition,
+      const std::vector<Aggregate>& aggregates) const;
+
+  /// Decrypts the result and returns one value per requested aggregate, in
+  /// the order they were requested.
+  std::vector<double> postProcessMultiAggregateQuery(
+      const MultiAggregateResult& res) const;
+
+  /// Returns the number of slots of each segment of a batch of compare
+  /// values: slotCount() divided by batchSize rounded up to a power of 2.
+  int getBatchSegmentSlots(int batchSize) const;
+
+  /// Encrypts a batch of values to compare against the given column in a
+  /// single CTile. Value b is replicated over the b-th segment of
+  /// getBatchSegmentSlots(vals.size()) slots.
+  helayers::CTile createBatchCompareValues(const std::vector<double>& vals,
+                                           const std::string& column) const;
+
+  /// Runs a batch of queries "WHERE <column> <comparisonType> <value b>", one
+  /// per value encrypted by createBatchCompareValues(), and packs all their
+  /// aggregates in a single CTile per partial sum. When the table fits in a
+  /// segment, its columns are replicated once into every segment (and kept
+  /// for later batches), so a single comparison evaluates the whole batch.
+  /// Otherwise, every block of a segment of rows is replicated into all the
+  /// segments in turn and compared against the whole batch, and the partial
+  /// sums are reduced once at the end. Over such a table a chunk takes as
+  /// many comparisons as there are segments, so the batch saves the
+  /// per-query reductions rather than comparisons. The masks are not cached.
+  BatchQueryResult batchQuery(const std::string& column,
+                              helayers::ComparisonType comparisonType,
+                              const helayers::CTile& compareValues,
+                              int batchSize,
+                              const std::vector<Aggregate>& aggregates) const;
+
+  /// Decrypts the result and returns, per query of the batch, one value per
+  /// requested aggregate.
+  std::vector<std::vector<double>> postProcessBatchQuery(
+      const BatchQueryResult& res) const;
+
+  /// Runs the query over a random sample of numSampleChunks chunks, chosen
+  /// by the server from the given seed. The table must have at most
+  /// slotCount() chunks.
+  SampledQueryResult sampledQuery(const Condition& condition,
+                                  const std::vector<Aggregate>& aggregates,
+                                  int numSampleChunks,
+                                  unsigned int seed) const;
+
+  /// Refines a sampled query with up to numMoreChunks more chunks of its
+  /// random order, so the client can decrypt a first estimate early and a
+  /// tighter one later.
+  void refineSampledQuery(SampledQueryResult& res, int numMoreChunks) const;
+
+  /// Decrypts the result and estimates every aggregate from the sampled
+  /// chunks, scaled up to the whole table by the ratio of its live rows to
+  /// those of the sampled chunks. The confidence interval is a normal
+  /// interval around the estimate, whose standard error is bootstrapped over
+  /// the sampled chunks and corrected for sampling without replacement, so it
+  /// shrinks to the exact value once all the chunks are sampled. With a
+  /// single chunk sampled out of several, the interval is (-inf, inf).
+  std::vector<ApproximateAggregate> postProcessSampledQuery(
+      const SampledQueryResult& res,
+      double confidence = 0.95) const;
+
+  /// Counts the rows of every bucket of an integer column. The buckets are
+  /// (-inf, b_1), [b_1, b_2), ..., [b_m, inf) for the given increasing
+  /// integer boundaries, which the comparisons keep half a step away from
+  /// every value. A table that fits in a batchQuery() segment is replicated
+  /// across the slots and compared against all the boundaries in one sign
+  /// evaluation. A larger table takes one comparison per chunk and boundary,
+  /// in a single pass over the chunks, and the counts of all the boundaries
+  /// are packed together by one reduction.
+  HistogramResult histogramQuery(const std::string& column,
+                                 const std::vector<int>& boundaries) const;
+
+  /// Decrypts the result and returns the m + 1 bucket counts.
+  std::vector<double> postProcessHistogramQuery(
+      const HistogramResult& res) const;
+
+  /// Estimates percentiles (between 0 and 100) of the column from decrypted
+  /// bucket counts, interpolating linearly within a bucket. The outer
+  /// buckets are bounded by the range of the column.
+  std::vector<double> estimatePercentiles(
+      const HistogramResult& res,
+      const std::vector<double>& bucketCounts,
+      const std::vector<double>& percentiles) const;
+
+  /// Returns the k largest (or smallest) distinct values of an integer
+  /// column, optionally only over the rows matching a condition. MAX and MIN
+  /// are the case k = 1. Rows that don't match are replaced by a value below
+  /// (or above) the column's range, and the values are reduced in a
+  /// tournament tree: first across chunks, in parallel, and then across slots
+  /// with rotations, so every value takes log2 of the number of rows
+  /// comparison levels. Every following value is found after the previous
+  /// one is knocked out of all the chunks, by comparing them against a
+  /// threshold half a step below (or above) it.
+  TopKResult topKQuery(
+      const std::string& column,
+      int k,
+      bool largest,
+      const std::optional<Condition>& condition = std::nullopt) const;
+
+  /// Decrypts the result. Values beyond the number of distinct values of the
+  /// matching rows are NaN.
+  std::vector<double> postProcessTopKQuery(const TopKResult& res) const;
+
+  /// Returns, for every chunk of this table, the number of rows of the other
+  /// table whose key equals the key of each row: the per-row match masks of
+  /// an equi-join, which are 0 or 1 when the other key is unique. Both tables
+  /// must be encrypted under the same HE context. The join is blocked by
+  /// chunk: every chunk of the other table is rotated through all its slots
+  /// (or through the smallest power of 2 covering its rows, when it is
+  /// replicated), and every rotation is compared for equality against all
+  /// the chunks of this table, in parallel threads. That is one equality
+  /// evaluation per chunk of this table and rotation: about 115K for a 100K
+  /// by 10K row join with 16384 slots.
+  std::vector<helayers::CTile> joinMatches(
+      const std::string& keyColumn,
+      const EncryptedTable& other,
+      const std::string& otherKeyColumn) const;
+
+  /// Aggregates columns of this table over its equi-join with the other
+  /// table, e.g. the SUM of tx_sum over the transactions of the customers in
+  /// the other table. A row matching several rows of the other table counts
+  /// once per match. To aggregate a column of the other table, call it on
+  /// the other table. The result is post-processed by
+  /// postProcessMultiAggregateQuery().
+  MultiAggregateResult joinQuery(
+      const std::string& keyColumn,
+      const EncryptedTable& other,
+      const std::string& otherKeyColumn,
+      const std::vector<Aggregate>& aggregates) const;
+
+  /// Plans a query without running it: picks the cheapest method to evaluate
+  /// every predicate given the range of its column, and estimates the depth,
+  /// number of multiplications and latency of the query. The latency is based
+  /// on the time of a multiplication under the table's HE context, measured
+  /// on first use, and doesn't include bootstrapping.
+  QueryPlan planQuery(const Condition& condition,
+                      const std::vector<Aggregate>& aggregates) const;
+
+  /// Computes the aggregates of every group of rows whose keyColumn equals one
+  /// of the given keys, optionally only over the rows matching a condition.
+  /// The groups share a ladder of comparisons: the mask of key k is the
+  /// difference of the "x > k - 1/2" and "x > k + 1/2" masks, so consecutive
+  /// keys share a comparison and no mask needs a multiplication. Every
+  /// boundary still takes a full comparison of every chunk, about k + 1 for k
+  /// consecutive keys. The partial sums of all the groups are packed by a
+  /// single rotation ladder. Unless the HE context bootstraps automatically,
+  /// throws if the depth of the query exceeds the depth of the context.
+  GroupByResult groupByQuery(
+      const std::string& keyColumn,
+      const std::vector<int>& keys,
+      const std::vector<Aggregate>& aggregates,
+      const std::optional<Condition>& condition = std::nullopt) const;
+
+  /// Decrypts the result and returns, per group key, one value per requested
+  /// aggregate.
+  std::vector<std::vector<double>> postProcessGroupByQuery(
+      const GroupByResult& res) const;
+
+  /// Sets the memory budget of the predicate mask cache. A budget of 0 (the
+  /// default) disables it.
+  void setMaskCacheBudget(size_t budgetBytes)
+  {
+    maskCache.setBudget(budgetBytes);
+  }
+
+  const MaskCache& getMaskCache() const { return maskCache; }
+
+private:
+  struct Column
+  {
+    // A scale of 0 marks a column with no values yet.
+    double scale = 0;
+    double minVal = 0;
+    double maxVal = 0;
+    std::vector<helayers::CTile> chunks;
+
+    // The offset and size of every chunk in the mapped file of a loaded
+    // table. The chunks are read on first use.
+    std::vector<std::pair<uint64_t, uint64_t>> segments;
+    bool loaded = true;
+  };
+
+  helayers::HeContext& he;
+  helayers::Encoder enc;
+  helayers::FunctionEvaluator fe;
+  CompareConfig compareConfig;
+  int numSlots;
+  int numRows;
+  int numChunks;
+  std::vector<std::string> columnNames;
+  mutable std::map<std::string, Column> columns;
+
+  // The file a loaded table is mapped from, and a lock for loading its
+  // columns.
+  std::shared_ptr<const MappedFile> mappedFile;
+  mutable std::mutex loadMutex;
+
+  // The tombstones of deleted rows, one per row.
+  std::vector<bool> deleted;
+  int numDeleted = 0;
+
+  // Ones in the slots of live rows and zeros elsewhere, for every chunk that
+  // has deleted rows or padding slots. Other chunks are all valid.
+  std::map<int, helayers::PTile> validity;
+
+  mutable MaskCache maskCache;
+
+  EncryptedTable(helayers::HeContext& he,
+                 const std::vector<std::string>& columnNames,
+                 const CompareConfig& compareConfig);
+
+  static void updateStats(Column& stats, double val);
+
+  // Sets the number of rows and allocates the chunks of every column.
+  void initLayout(int rows, const std::vector<Column>& stats);
+
+  // Computes the validity of all the chunks.
+  void initValidity();
+
+  void updateValidity(int chunk);
+
+  // Returns the validity of the chunk, or nullptr if all its slots are valid.
+  const helayers::PTile* getValidity(int chunk) const;
+
+  void encryptChunk(int col, int chunk, const double* vals, int numVals);
+
+  // Adds the values to the free slots of a chunk, starting at the given slot.
+  void appendToChunk(int col,
+                     int chunk,
+                     int firstSlot,
+                     const double* vals,
+                     int numVals);
+
+  // Returns the column, reading its chunks first if load is true and it was
+  // not loaded yet.
+  const Column& getColumn(const std::string& name, bool load = true) const;
+
+  void loadColumn(Column& column) const;
+
+  // Returns the larger (or smaller) of a and b in every slot.
+  helayers::CTile tournamentMatch(const helayers::CTile& a,
+                                  const helayers::CTile& b,
+                                  bool largest,
+                                  const Column& column) const;
+
+  // Reduces the values to their largest (or smallest) value, in all slots.
+  helayers::CTile tournament(std::vector<helayers::CTile> vals,
+                             bool largest,
+                             const Column& column) const;
+
+  // Returns the number of integers a comparison of the column may see: its
+  // values and the zeros of padding slots.
+  static int compareRange(const Column& column);
+
+  // Returns the number of bits of compareRange().
+  static int compareBits(const Column& column);
+
+  // Returns the comparison parameters of the column, adapted to its range.
+  CompareConfig columnCompareConfig(const Column& column) const;
+
+  // Returns 1 where a > b, 0 where a < b and 0.5 where they are equal, for
+  // values of the given column.
+  helayers::CTile compare(const helayers::CTile& a,
+                          const helayers::CTile& b,
+                          const Column& column) const;
+
+  // The masks of the predicates of a condition, taken from the mask cache
+  // where possible.
+  struct ConditionMasks
+  {
+    std::vector<const Predicate*> predicates;
+    std::vector<std::optional<MaskKey>> keys;
+    std::vector<CompareMethod> methods;
+    std::vector<std::shared_ptr<const Mask>> cached;
+    // The masks computed for the cache, if it is enabled.
+    std::vector<std::shared_ptr<Mask>> computed;
+  };
+
+  helayers::CTile computeMask(const Predicate& predicate,
+                              CompareMethod method,
+                              int chunk) const;
+
+  // Compares the chunk x of a column with the compare value, slot by slot.
+  helayers::CTile compareColumn(const helayers::CTile& x,
+                                const helayers::CTile& compareValue,
+                                const Column& column,
+                                helayers::ComparisonType comparisonType,
+                                CompareMethod method) const;
+
+  // Returns the cheapest method to compute the mask of a predicate, with its
+  // depth and number of multiplications.
+  PredicatePlan planPredicate(const Predicate& predicate) const;
+
+  // The same, for a comparison over the range of the given column.
+  PredicatePlan planComparison(const Column& column,
+                               helayers::ComparisonType comparisonType) const;
+
+  // The mask of "x == val" computed by the CMP_INDICATOR method.
+  helayers::CTile indicatorMask(const helayers::CTile& x,
+                                const helayers::CTile& val,
+                                const Column& column) const;
+
+  // The single chunk of a column, replicated into every segment of a batch,
+  // by column name and segment size. Cleared when rows are appended.
+  mutable std::map<std::pair<std::string, int>, helayers::CTile>
+      replicatedColumns;
+  mutable std::mutex replicatedMutex;
+
+  const helayers::CTile& getReplicatedColumn(const std::string& name,
+                                             int segmentSlots) const;
+
+  BatchQueryResult replicatedBatchQuery(
+      const std::string& column,
+      helayers::ComparisonType comparisonType,
+      const helayers::CTile& compareValues,
+      int batchSize,
+      const std::vector<Aggregate>& aggregates) const;
+
+  // The block-th segment of segmentSlots slots of a chunk, replicated into
+  // every segment. firstSegment is 1 in the first segment and 0 elsewhere.
+  helayers::CTile replicateBlock(const helayers::CTile& chunk,
+                                 int block,
+                                 const helayers::PTile& firstSegment,
+                                 int segmentSlots) const;
+
+  BatchQueryResult chunkedBatchQuery(
+      const std::string& column,
+      helayers::ComparisonType comparisonType,
+      const helayers::CTile& compareValues,
+      int batchSize,
+      const std::vector<Aggregate>& aggregates) const;
+
+  // The time of a multiplication, measured on first use by planQuery().
+  mutable std::once_flag multiplyTimeOnce;
+  mutable double multiplySec = 0;
+
+  void measureMultiplyTime() const;
+
+  ConditionMasks prepareMasks(const Condition& condition) const;
+
+  // Returns the mask of the condition for the given chunk, including the
+  // validity of its slots.
+  helayers::CTile evaluateCondition(const Condition& condition,
+                                    ConditionMasks& masks,
+                                    int chunk) const;
+
+  helayers::CTile combineMasks(const Condition& condition,
+                               std::vector<helayers::CTile>& predicateMasks,
+                               size_t& next) const;
+
+  // Multiplies the factors, always multiplying the two with the most
+  // remaining levels first.
+  helayers::CTile multiplyBalanced(std::vector<helayers::CTile>& factors) const;
+
+  // Adds the computed masks to the cache.
+  void storeMasks(ConditionMasks& masks) const;
+
+  double sumSlots(const helayers::CTile& c) const;
+
+  // Sets every slot i to the sum of slots i, ..., i + numSummed - 1, where
+  // numSummed is a power of 2 and the slots wrap around.
+  void rotateAndSum(helayers::CTile& c, int numSummed) const;
+
+  // Returns the sum of all the slots of vals[i] divided by the number of rows
+  // in slot firstSlot + i, for every i, with zeros elsewhere. Costs about
+  // vals.size() + log(slotCount()) rotations, instead of a full rotation
+  // ladder per value.
+  helayers::CTile packSums(const std::vector<helayers::CTile>& vals,
+                           int firstSlot) const;
+
+  // Decrypts partial sums packed at slots 0, stride, 2 * stride, ..., and
+  // derives the aggregates of each of the numResults results.
+  std::vector<std::vector<double>> unpackAggregates(
+      const std::vector<Aggregate>& aggregates,
+      const std::optional<helayers::CTile>& counts,
+      const std::map<std::string, helayers::CTile>& sums,
+      const std::map<std::string, helayers::CTile>& sumsOfSquares,
+      int numResults,
+      int stride) const;
+
+  static void accumulate(std::optional<helayers::CTile>& acc,
+                         const helayers::CTile& val);
+
+  // The partial sums of a query over some of the chunks.
+  struct PartialSums
+  {
+    std::optional<helayers::CTile> count;
+    std::map<std::string, std::optional<helayers::CTile>> sums;
+    std::map<std::string, std::optional<helayers::CTile>> sumsOfSquares;
+
+    void add(const PartialSums& other);
+  };
+
+  // Adds all the partial sums into the first one, in a tree of parallel
+  // additions.
+  static void reducePartialSums(std::vector<PartialSums>& partials);
+
+  // Finds the partial sums needed by the aggregates: the count, and the sum
+  // (and possibly the sum of squares) of every aggregated column.
+  void findPartialSums(const std::vector<Aggregate>& aggregates,
+                       bool& needCount,
+                       std::map<std::string, bool>& needSumOfSquares) const;
+
+  // Derives the aggregates from the decrypted partial sums.
+  static std::vector<double> deriveAggregates(
+      const std::vector<Aggregate>& aggregates,
+      double count,
+      const std::map<std::string, double>& sums,
+      const std::map<std::string, double>& sumsOfSquares);
+};
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Batched queries of EncryptedTable.
+//
+// The slots of a batch are split into one segment per query. A table that
+// fits in a segment is replicated into all of them, so one comparison of the
+// replicated column against the batch of compare values evaluates every
+// query, and the partial sums of every segment are summed with rotations
+// within the segment.
+//
+// A larger table is split into blocks of one segment of rows, and every
+// block is replicated into all the segments in turn. One comparison then
+// evaluates the whole batch over a block, and the partial sums of all the
+// blocks are accumulated per segment and summed within the segments once.
+// Every row still has to meet every compare value in some slot, so a chunk
+// takes as many comparisons as there are segments (the batch size rounded up
+// to a power of 2), like one query per value. What batching saves on a large
+// table is the per-query reduction and extraction, not comparisons.
+
+#include <omp.h>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+int EncryptedTable::getBatchSegmentSlots(int batchSize) const
+{
+  if (batchSize < 1 || batchSize > numSlots)
+    throw runtime_error("The batch size must be between 1 and " +
+                        to_string(numSlots));
+  int numSegments = 1;
+  while (numSegments < batchSize)
+    numSegments *= 2;
+  return numSlots / numSegments;
+}
+
+CTile EncryptedTable::createBatchCompareValues(const vector<double>& vals,
+                                               const string& column) const
+{
+  const Column& col = getColumn(column, false);
+  int segmentSlots = getBatchSegmentSlots(vals.size());
+  vector<double> slots(numSlots, 0);
+  for (size_t b = 0; b < vals.size(); ++b) {
+    // Clamped as in createCompareValue()
+    double val = min(max(vals[b], col.minVal - 1), col.maxVal + 1);
+    fill_n(slots.begin() + b * segmentSlots, segmentSlots, val / col.scale);
+  }
+  CTile res(he);
+  enc.encodeEncrypt(res, slots);
+  return res;
+}
+
+const CTile& EncryptedTable::getReplicatedColumn(const string& name,
+                                                 int segmentSlots) const
+{
+  lock_guard<mutex> lock(replicatedMutex);
+  auto key = make_pair(name, segmentSlots);
+  auto it = replicatedColumns.find(key);
+  if (it != replicatedColumns.end())
+    return it->second;
+
+  // The slots past the last row are zeros, so the rotated copies don't
+  // overlap.
+  CTile res = getColumn(name).chunks.at(0);
+  for (int rot = segmentSlots; rot < numSlots; rot *= 2) {
+    CTile tmp = res;
+    tmp.rotate(-rot);
+    res.add(tmp);
+  }
+  return replicatedColumns.emplace(key, move(res)).first->second;
+}
+
+BatchQueryResult EncryptedTable::batchQuery(
+    const string& column,
+    ComparisonType comparisonType,
+    const CTile& compareValues,
+    int batchSize,
+    const vector<Aggregate>& aggregates) const
+{
+  if (numRows <= getBatchSegmentSlots(batchSize))
+    return replicatedBatchQuery(
+        column, comparisonType, compareValues, batchSize, aggregates);
+  return chunkedBatchQuery(
+      column, comparisonType, compareValues, batchSize, aggregates);
+}
+
+BatchQueryResult EncryptedTable::replicatedBatchQuery(
+    const string& column,
+    ComparisonType comparisonType,
+    const CTile& compareValues,
+    int batchSize,
+    const vector<Aggregate>& aggregates) const
+{
+  int segmentSlots = getBatchSegmentSlots(batchSize);
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(aggregates, needCount, needSumOfSquares);
+
+  Predicate pred{column, comparisonType, compareValues};
+  CTile mask = compareColumn(getReplicatedColumn(column, segmentSlots),
+                             compareValues,
+                             getColumn(column),
+                             comparisonType,
+                             planPredicate(pred).method);
+
+  // Only the live rows of the segments in use match. The partial sums of
+  // every segment are then summed into its first slot.
+  vector<double> valid(numSlots, 0);
+  vector<double> firstSlots(numSlots, 0);
+  for (int b = 0; b < batchSize; ++b) {
+    for (int row = 0; row < numRows; ++row)
+      valid[b * segmentSlots + row] = deleted[row] ? 0 : 1;
+    firstSlots[b * segmentSlots] = 1;
+  }
+  PTile validPlain(he);
+  enc.encode(validPlain, valid);
+  mask.multiplyPlain(validPlain);
+  PTile firstSlotsPlain(he);
+  enc.encode(firstSlotsPlain, firstSlots);
+
+  auto pack = [&](CTile partial) {
+    partial.multiplyScalar(1.0 / numRows);
+    rotateAndSum(partial, segmentSlots);
+    partial.multiplyPlain(firstSlotsPlain);
+    return partial;
+  };
+
+  BatchQueryResult res;
+  res.batchSize = batchSize;
+  res.stride = segmentSlots;
+  res.aggregates = aggregates;
+  if (needCount)
+    res.counts = pack(mask);
+  for (const auto& [colName, withSquares] : needSumOfSquares) {
+    const CTile& x = getReplicatedColumn(colName, segmentSlots);
+    CTile masked = mask;
+    masked.multiply(x);
+    res.sums.emplace(colName, pack(masked));
+    if (withSquares) {
+      masked.multiply(x);
+      res.sumsOfSquares.emplace(colName, pack(masked));
+    }
+  }
+  return res;
+}
+
+CTile EncryptedTable::replicateBlock(const CTile& chunk,
+                                     int block,
+                                     const PTile& firstSegment,
+                                     int segmentSlots) const
+{
+  CTile res = chunk;
+  if (block > 0)
+    res.rotate(block * segmentSlots);
+  res.multiplyPlain(firstSegment);
+  for (int rot = segmentSlots; rot < numSlots; rot *= 2) {
+    CTile tmp = res;
+    tmp.rotate(-rot);
+    res.add(tmp);
+  }
+  return res;
+}
+
+BatchQueryResult EncryptedTable::chunkedBatchQuery(
+    const string& column,
+    ComparisonType comparisonType,
+    const CTile& compareValues,
+    int batchSize,
+    const vector<Aggregate>& aggregates) const
+{
+  int segmentSlots = getBatchSegmentSlots(batchSize);
+  int blocksPerChunk = numSlots / segmentSlots;
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(aggregates, needCount, needSumOfSquares);
+
+  // Load the columns up front, so that the threads below only read them
+  const Column& col = getColumn(column);
+  for (const auto& [colName, withSquares] : needSumOfSquares)
+    getColumn(colName);
+  CompareMethod method = planComparison(col, comparisonType).method;
+
+  vector<double> segment(numSlots, 0);
+  fill_n(segment.begin(), segmentSlots, 1);
+  PTile firstSegment(he);
+  enc.encode(firstSegment, segment);
+
+  // The blocks that hold rows. A task compares one of them against the
+  // whole batch.
+  vector<pair<int, int>> tasks;
+  for (int chunk = 0; chunk < numChunks; ++chunk)
+    for (int block = 0; block < blocksPerChunk; ++block)
+      if (chunk * numSlots + block * segmentSlots < numRows)
+        tasks.emplace_back(chunk, block);
+
+  int numThreads = max(1, min((int)tasks.size(), omp_get_max_threads()));
+  vector<PartialSums> partials(numThreads);
+
+#pragma omp parallel num_threads(numThreads)
+  {
+    HELAYERS_TIMER("batch thread");
+    PartialSums& partial = partials[omp_get_thread_num()];
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < (int)tasks.size(); ++t) {
+      auto [chunk, block] = tasks[t];
+      CTile mask = compareColumn(
+          replicateBlock(col.chunks[chunk], block, firstSegment, segmentSlots),
+          compareValues,
+          col,
+          comparisonType,
+          method);
+
+      // Only the live rows of the block, in the segments in use, match
+      int first = chunk * numSlots + block * segmentSlots;
+      vector<double> valid(numSlots, 0);
+      for (int b = 0; b < batchSize; ++b)
+        for (int i = 0; i < segmentSlots && first + i < numRows; ++i)
+          valid[b * segmentSlots + i] = deleted[first + i] ? 0 : 1;
+      PTile validPlain(he);
+      enc.encode(validPlain, valid);
+      mask.multiplyPlain(validPlain);
+
+      if (needCount)
+        accumulate(partial.count, mask);
+      for (const auto& [colName, withSquares] : needSumOfSquares) {
+        CTile x = replicateBlock(getColumn(colName).chunks[chunk],
+                                 block,
+                                 firstSegment,
+                                 segmentSlots);
+        CTile masked = mask;
+        masked.multiply(x);
+        accumulate(partial.sums[colName], masked);
+        if (withSquares) {
+          masked.multiply(x);
+          accumulate(partial.sumsOfSquares[colName], masked);
+        }
+      }
+    }
+  }
+  reducePartialSums(partials);
+
+  // The partial sums of every segment are summed into its first slot once,
+  // for all the blocks
+  vector<double> firstSlots(numSlots, 0);
+  for (int b = 0; b < batchSize; ++b)
+    firstSlots[b * segmentSlots] = 1;
+  PTile firstSlotsPlain(he);
+  enc.encode(firstSlotsPlain, firstSlots);
+  auto pack = [&](optional<CTile>& partial) {
+    partial->multiplyScalar(1.0 / numRows);
+    rotateAndSum(*partial, segmentSlots);
+    partial->multiplyPlain(firstSlotsPlain);
+    return move(*partial);
+  };
+
+  PartialSums& total = partials[0];
+  BatchQueryResult res;
+  res.batchSize = batchSize;
+  res.stride = segmentSlots;
+  res.aggregates = aggregates;
+  if (needCount)
+    res.counts = pack(total.count);
+  for (auto& [colName, sum] : total.sums)
+    res.sums.emplace(colName, pack(sum));
+  for (auto& [colName, sumOfSquares] : total.sumsOfSquares)
+    res.sumsOfSquares.emplace(colName, pack(sumOfSquares));
+  return res;
+}
+
+vector<vector<double>> EncryptedTable::postProcessBatchQuery(
+    const BatchQueryResult& res) const
+{
+  return unpackAggregates(res.aggregates,
+                          res.counts,
+                          res.sums,
+                          res.sumsOfSquares,
+                          res.batchSize,
+                          res.stride);
+}
@@ -0,0 +1,217 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// GROUP BY queries of EncryptedTable.
+//
+// The rows of key k are those with k - 1/2 < x < k + 1/2. The query compares
+// the key column once against every distinct boundary k +- 1/2, accumulates
+// the partial sums of the rows above every boundary, and derives the partial
+// sums of key k as the difference of its two boundaries. A boundary below the
+// range of the column matches every row and needs no comparison, and one above
+// it matches no row.
+//
+// Every slot of a chunk already holds a row, so a comparison covers a single
+// boundary: the query costs one comparison per boundary and chunk. The
+// partial sums of all the groups are packed together by packSums(), with a
+// single rotation ladder.
+
+#include <algorithm>
+#include <cmath>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+GroupByResult EncryptedTable::groupByQuery(const string& keyColumn,
+                                           const vector<int>& keys,
+                                           const vector<Aggregate>& aggregates,
+                                           const optional<Condition>& condition)
+    const
+{
+  if (keys.empty() || (int)keys.size() > numSlots)
+    throw runtime_error("The number of group keys must be between 1 and " +
+                        to_string(numSlots));
+
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(aggregates, needCount, needSumOfSquares);
+
+  const Column& column = getColumn(keyColumn);
+
+  if (!he.getAutomaticBootstrapping()) {
+    // The boundary comparison is multiplied by the condition (or the
+    // validity), then by the aggregated column, and packed
+    int depth = planComparison(column, IS_GREATER).depth;
+    if (condition.has_value())
+      depth = max(depth, planQuery(*condition, {}).depth);
+    int aggregateDepth = 0;
+    for (const auto& [colName, withSquares] : needSumOfSquares)
+      aggregateDepth = max(aggregateDepth, withSquares ? 2 : 1);
+    depth += 1 + aggregateDepth + (int)ceil(log2(keys.size())) + 1;
+    if (depth > he.getTopChainIndex())
+      throw runtime_error("The query needs a multiplication depth of " +
+                          to_string(depth) + ", but the HE context has " +
+                          to_string(he.getTopChainIndex()) +
+                          ". Enable bootstrapping or simplify the condition.");
+  }
+
+  vector<double> boundaries;
+  for (int key : keys) {
+    boundaries.push_back(key - 0.5);
+    boundaries.push_back(key + 0.5);
+  }
+  sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+  int numBoundaries = boundaries.size();
+
+  auto boundaryIndex = [&](double boundary) {
+    return lower_bound(boundaries.begin(), boundaries.end(), boundary) -
+           boundaries.begin();
+  };
+
+  // The compare values of the boundaries inside the range of the column
+  vector<optional<CTile>> compareVals(numBoundaries);
+  vector<bool> matchesNone(numBoundaries);
+  for (int b = 0; b < numBoundaries; ++b) {
+    matchesNone[b] = boundaries[b] > column.maxVal;
+    if (boundaries[b] < column.minVal || matchesNone[b])
+      continue;
+    compareVals[b].emplace(he);
+    enc.encodeEncrypt(*compareVals[b],
+                      vector<double>(numSlots, boundaries[b] / column.scale));
+  }
+
+  // The mask of a boundary that matches every row, when there is no condition
+  CTile ones(he);
+  enc.encodeEncrypt(ones, vector<double>(numSlots, 1));
+
+  optional<ConditionMasks> masks;
+  if (condition.has_value())
+    masks = prepareMasks(*condition);
+
+  // The partial sums of the rows above every boundary. All the entries are
+  // created here, so that the threads below only update existing ones.
+  vector<optional<CTile>> counts(numBoundaries);
+  map<string, vector<optional<CTile>>> sums;
+  map<string, vector<optional<CTile>>> sumsOfSquares;
+  for (const auto& [colName, withSquares] : needSumOfSquares) {
+    getColumn(colName);
+    sums[colName].resize(numBoundaries);
+    if (withSquares)
+      sumsOfSquares[colName].resize(numBoundaries);
+  }
+
+  for (int chunk = 0; chunk < numChunks; ++chunk) {
+    const PTile* valid = getValidity(chunk);
+    optional<CTile> where;
+    if (condition.has_value())
+      where = evaluateCondition(*condition, *masks, chunk);
+    const CTile& x = column.chunks[chunk];
+
+#pragma omp parallel for
+    for (int b = 0; b < numBoundaries; ++b) {
+      if (matchesNone[b])
+        continue;
+
+      CTile mask(he);
+      if (compareVals[b].has_value()) {
+        mask = compare(x, *compareVals[b], column);
+        if (where.has_value())
+          mask.multiply(*where);
+        else if (valid != nullptr)
+          mask.multiplyPlain(*valid);
+      } else if (where.has_value())
+        mask = *where;
+      else {
+        mask = ones;
+        if (valid != nullptr)
+          mask.multiplyPlain(*valid);
+      }
+
+      if (needCount)
+        accumulate(counts[b], mask);
+
+      for (const auto& [colName, withSquares] : needSumOfSquares) {
+        const CTile& val = getColumn(colName).chunks[chunk];
+        CTile masked = mask;
+        masked.multiply(val);
+        accumulate(sums.at(colName)[b], masked);
+        if (withSquares) {
+          masked.multiply(val);
+          accumulate(sumsOfSquares.at(colName)[b], masked);
+        }
+      }
+    }
+  }
+
+  if (masks.has_value())
+    storeMasks(*masks);
+
+  // A group without rows above its lower boundary sums to zero
+  CTile zeros(he);
+  enc.encodeEncrypt(zeros, vector<double>(numSlots, 0));
+
+  // Packs the partial sums of the groups in a single CTile, slot g holding
+  // group g
+  auto pack = [&](const vector<optional<CTile>>& aboveBoundary) {
+    HELAYERS_TIMER("group by packing");
+    int numKeys = keys.size();
+    vector<CTile> groups(numKeys, zeros);
+#pragma omp parallel for
+    for (int g = 0; g < numKeys; ++g) {
+      const optional<CTile>& low = aboveBoundary[boundaryIndex(keys[g] - 0.5)];
+      const optional<CTile>& high = aboveBoundary[boundaryIndex(keys[g] + 0.5)];
+      if (!low.has_value())
+        continue;
+      groups[g] = *low;
+      if (high.has_value())
+        groups[g].sub(*high);
+    }
+    return packSums(groups, 0);
+  };
+
+  GroupByResult res;
+  res.keys = keys;
+  res.aggregates = aggregates;
+  if (needCount)
+    res.counts = pack(counts);
+  for (const auto& [colName, aboveBoundary] : sums)
+    res.sums.emplace(colName, pack(aboveBoundary));
+  for (const auto& [colName, aboveBoundary] : sumsOfSquares)
+    res.sumsOfSquares.emplace(colName, pack(aboveBoundary));
+  return res;
+}
+
+vector<vector<double>> EncryptedTable::postProcessGroupByQuery(
+    const GroupByResult& res) const
+{
+  return unpackAggregates(res.aggregates,
+                          res.counts,
+                          res.sums,
+                          res.sumsOfSquares,
+                          res.keys.size(),
+                          1);
+}
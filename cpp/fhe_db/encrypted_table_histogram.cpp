@@ -0,0 +1,173 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Histogram queries of EncryptedTable.
+//
+// The number of rows below every boundary is computed as a batch of COUNT
+// queries, whose results the client turns into bucket counts.
+
+#include <algorithm>
+
+#include <omp.h>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+HistogramResult EncryptedTable::histogramQuery(
+    const string& column,
+    const vector<int>& boundaries) const
+{
+  if (boundaries.empty() || (int)boundaries.size() > numSlots)
+    throw runtime_error("The number of boundaries must be between 1 and " +
+                        to_string(numSlots));
+  if (adjacent_find(boundaries.begin(),
+                    boundaries.end(),
+                    greater_equal<int>()) != boundaries.end())
+    throw runtime_error("The bucket boundaries must be increasing");
+
+  HistogramResult res;
+  res.column = column;
+  res.boundaries = boundaries;
+  int numBoundaries = boundaries.size();
+
+  // A table that fits in a segment is replicated across the slots, and
+  // compared against all the boundaries in one sign evaluation
+  if (numRows <= getBatchSegmentSlots(numBoundaries)) {
+    res.belowBoundaries =
+        batchQuery(column,
+                   IS_SMALLER,
+                   createBatchCompareValues(
+                       vector<double>(boundaries.begin(), boundaries.end()),
+                       column),
+                   numBoundaries,
+                   {{AGG_COUNT, ""}});
+    return res;
+  }
+
+  // A larger table would need one comparison per segment of every chunk
+  // after replication, as many as the boundaries rounded up to a power of 2.
+  // Instead, every chunk is compared against every boundary as is, in one
+  // pass over the chunks. The counts below every boundary are accumulated
+  // over the chunks, and then packed together by a single reduction.
+  const Column& col = getColumn(column);
+  CompareMethod method = planComparison(col, IS_SMALLER).method;
+  vector<CTile> compareVals;
+  for (int b : boundaries)
+    compareVals.push_back(createCompareValue(b, column));
+
+  int numTasks = numChunks * numBoundaries;
+  int numThreads = max(1, min(numTasks, omp_get_max_threads()));
+  vector<vector<optional<CTile>>> partials(
+      numThreads, vector<optional<CTile>>(numBoundaries));
+#pragma omp parallel num_threads(numThreads)
+  {
+    HELAYERS_TIMER("histogram thread");
+    vector<optional<CTile>>& partial = partials[omp_get_thread_num()];
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < numTasks; ++t) {
+      int chunk = t / numBoundaries;
+      int b = t % numBoundaries;
+      CTile mask = compareColumn(
+          col.chunks[chunk], compareVals[b], col, IS_SMALLER, method);
+      const PTile* valid = getValidity(chunk);
+      if (valid != nullptr)
+        mask.multiplyPlain(*valid);
+      accumulate(partial[b], mask);
+    }
+  }
+
+  vector<CTile> below;
+  for (int b = 0; b < numBoundaries; ++b) {
+    optional<CTile> total;
+    for (const vector<optional<CTile>>& partial : partials)
+      if (partial[b].has_value())
+        accumulate(total, *partial[b]);
+    below.push_back(move(*total));
+  }
+
+  BatchQueryResult& batch = res.belowBoundaries;
+  batch.batchSize = numBoundaries;
+  batch.stride = 1;
+  batch.aggregates = {{AGG_COUNT, ""}};
+  batch.counts = packSums(below, 0);
+  return res;
+}
+
+vector<double> EncryptedTable::postProcessHistogramQuery(
+    const HistogramResult& res) const
+{
+  vector<vector<double>> below = postProcessBatchQuery(res.belowBoundaries);
+  // Bucket j holds the rows below boundary j and not below boundary j - 1,
+  // and the last one the rest of the live rows
+  vector<double> counts;
+  double prev = 0;
+  for (const vector<double>& count : below) {
+    counts.push_back(count.at(0) - prev);
+    prev = count.at(0);
+  }
+  counts.push_back(numRows - numDeleted - prev);
+  return counts;
+}
+
+vector<double> EncryptedTable::estimatePercentiles(
+    const HistogramResult& res,
+    const vector<double>& bucketCounts,
+    const vector<double>& percentiles) const
+{
+  const vector<int>& bounds = res.boundaries;
+  int numBuckets = bounds.size() + 1;
+  if ((int)bucketCounts.size() != numBuckets)
+    throw runtime_error("Expected " + to_string(numBuckets) + " bucket counts");
+
+  // The edges of the buckets, and their counts, which may come out slightly
+  // negative from the approximate comparisons
+  const Column& col = getColumn(res.column, false);
+  vector<double> edges;
+  edges.push_back(min(col.minVal, (double)bounds.front()));
+  edges.insert(edges.end(), bounds.begin(), bounds.end());
+  edges.push_back(max(col.maxVal + 1, (double)bounds.back()));
+  vector<double> counts;
+  double total = 0;
+  for (double count : bucketCounts) {
+    counts.push_back(max(count, 0.0));
+    total += counts.back();
+  }
+
+  vector<double> vals;
+  for (double p : percentiles) {
+    if (p < 0 || p > 100)
+      throw runtime_error("Percentiles must be between 0 and 100");
+    double target = p / 100 * total;
+    double below = 0;
+    int b = 0;
+    while (b < numBuckets - 1 && below + counts[b] < target)
+      below += counts[b++];
+    double frac = counts[b] > 0 ? (target - below) / counts[b] : 0;
+    vals.push_back(edges[b] + min(frac, 1.0) * (edges[b + 1] - edges[b]));
+  }
+  return vals;
+}
@@ -0,0 +1,300 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Saving and loading of EncryptedTable.
+//
+// File layout:
+//   magic, version
+//   HE context signature, number of slots, number of rows
+//   number of columns, then per column: name, scale, min, max
+//   number of deleted rows, then their indices
+//   the serialized chunks: column by column, chunk by chunk
+//   the index: (offset, size) of every chunk, in the same order
+//   the offset of the index, magic
+
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+static const char fileMagic[8] = {'F', 'H', 'E', 'D', 'B', 'T', 'B', 'L'};
+static const uint32_t fileVersion = 1;
+
+// A read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+  explicit MappedFile(const string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw runtime_error("Failed to open " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw runtime_error("Failed to stat " + path);
+    }
+    length = st.st_size;
+    void* addr = MAP_FAILED;
+    if (length > 0)
+      addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      throw runtime_error("Failed to map " + path);
+    bytes = static_cast<const char*>(addr);
+  }
+
+  ~MappedFile() { munmap(const_cast<char*>(bytes), length); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return bytes; }
+
+  size_t size() const { return length; }
+
+private:
+  const char* bytes = nullptr;
+  size_t length = 0;
+};
+
+namespace {
+
+// An input stream over a range of memory, used to deserialize ciphertexts
+// directly from the mapped file.
+class MemoryBuf : public streambuf
+{
+public:
+  MemoryBuf(const char* begin, size_t size)
+  {
+    char* p = const_cast<char*>(begin);
+    setg(p, p, p + size);
+  }
+
+protected:
+  pos_type seekoff(off_type off,
+                   ios_base::seekdir dir,
+                   ios_base::openmode which) override
+  {
+    char* target = dir == ios_base::beg   ? eback() + off
+                   : dir == ios_base::cur ? gptr() + off
+                                          : egptr() + off;
+    if (target < eback() || target > egptr())
+      return pos_type(off_type(-1));
+    setg(eback(), target, egptr());
+    return pos_type(target - eback());
+  }
+
+  pos_type seekpos(pos_type pos, ios_base::openmode which) override
+  {
+    return seekoff(off_type(pos), ios_base::beg, which);
+  }
+};
+
+class MemoryStream : public istream
+{
+public:
+  MemoryStream(const char* begin, size_t size) : istream(&buf), buf(begin, size)
+  {
+  }
+
+private:
+  MemoryBuf buf;
+};
+
+template <typename T>
+void writeValue(ostream& out, const T& val)
+{
+  out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template <typename T>
+T readValue(istream& in)
+{
+  T val;
+  in.read(reinterpret_cast<char*>(&val), sizeof(T));
+  if (!in)
+    throw runtime_error("Truncated encrypted table file");
+  return val;
+}
+
+void writeString(ostream& out, const string& str)
+{
+  writeValue<uint64_t>(out, str.size());
+  out.write(str.data(), str.size());
+}
+
+string readString(istream& in)
+{
+  string str(readValue<uint64_t>(in), '\0');
+  in.read(&str[0], str.size());
+  if (!in)
+    throw runtime_error("Truncated encrypted table file");
+  return str;
+}
+
+string contextSignature(const HeContext& he)
+{
+  stringstream ss;
+  he.printSignature(ss);
+  return ss.str();
+}
+
+} // namespace
+
+void EncryptedTable::saveToFile(const string& path) const
+{
+  ofstream out(path, ios::out | ios::binary);
+  if (!out.is_open())
+    throw runtime_error("Failed to open " + path);
+
+  out.write(fileMagic, sizeof(fileMagic));
+  writeValue<uint32_t>(out, fileVersion);
+  writeString(out, contextSignature(he));
+  writeValue<int32_t>(out, numSlots);
+  writeValue<int64_t>(out, numRows);
+  writeValue<int32_t>(out, columnNames.size());
+  for (const string& name : columnNames) {
+    const Column& column = getColumn(name, false);
+    writeString(out, name);
+    writeValue<double>(out, column.scale);
+    writeValue<double>(out, column.minVal);
+    writeValue<double>(out, column.maxVal);
+  }
+  writeValue<int64_t>(out, numDeleted);
+  for (int row = 0; row < numRows; ++row)
+    if (deleted[row])
+      writeValue<int64_t>(out, row);
+
+  vector<pair<uint64_t, uint64_t>> index;
+  index.reserve(columnNames.size() * numChunks);
+  for (const string& name : columnNames) {
+    const Column& column = getColumn(name);
+    for (const CTile& chunk : column.chunks) {
+      uint64_t offset = out.tellp();
+      chunk.save(out);
+      index.emplace_back(offset, (uint64_t)out.tellp() - offset);
+    }
+  }
+
+  uint64_t indexOffset = out.tellp();
+  for (const auto& [offset, size] : index) {
+    writeValue<uint64_t>(out, offset);
+    writeValue<uint64_t>(out, size);
+  }
+  writeValue<uint64_t>(out, indexOffset);
+  out.write(fileMagic, sizeof(fileMagic));
+
+  if (!out)
+    throw runtime_error("Failed to write " + path);
+}
+
+unique_ptr<EncryptedTable> EncryptedTable::loadFromFile(
+    HeContext& he,
+    const string& path,
+    const CompareConfig& compareConfig)
+{
+  shared_ptr<const MappedFile> file = make_shared<MappedFile>(path);
+  size_t trailerSize = sizeof(uint64_t) + sizeof(fileMagic);
+  if (file->size() < sizeof(fileMagic) + trailerSize ||
+      memcmp(file->data(), fileMagic, sizeof(fileMagic)) != 0 ||
+      memcmp(file->data() + file->size() - sizeof(fileMagic),
+             fileMagic,
+             sizeof(fileMagic)) != 0)
+    throw runtime_error(path + " is not an encrypted table file");
+
+  MemoryStream in(file->data(), file->size());
+  in.seekg(sizeof(fileMagic));
+  if (readValue<uint32_t>(in) != fileVersion)
+    throw runtime_error("Unsupported encrypted table file version in " + path);
+  if (readString(in) != contextSignature(he) ||
+      readValue<int32_t>(in) != he.slotCount())
+    throw runtime_error(path + " was saved under a different HE context");
+  int rows = readValue<int64_t>(in);
+
+  int numCols = readValue<int32_t>(in);
+  vector<string> names;
+  vector<Column> stats(numCols);
+  for (int c = 0; c < numCols; ++c) {
+    names.push_back(readString(in));
+    stats[c].scale = readValue<double>(in);
+    stats[c].minVal = readValue<double>(in);
+    stats[c].maxVal = readValue<double>(in);
+  }
+  int64_t numDeletedRows = readValue<int64_t>(in);
+  if (numDeletedRows < 0 || numDeletedRows > rows)
+    throw runtime_error("Corrupted encrypted table file " + path);
+  vector<int> deletedRows(numDeletedRows);
+  for (int& row : deletedRows) {
+    row = readValue<int64_t>(in);
+    if (row < 0 || row >= rows)
+      throw runtime_error("Corrupted encrypted table file " + path);
+  }
+
+  // The constructor is private, so make_unique can't be used
+  unique_ptr<EncryptedTable> table(
+      new EncryptedTable(he, names, compareConfig));
+  table->numRows = rows;
+  table->numChunks = (rows + table->numSlots - 1) / table->numSlots;
+  table->initValidity();
+  table->deleteRows(deletedRows);
+  table->mappedFile = file;
+
+  MemoryStream trailer(file->data() + file->size() - trailerSize, trailerSize);
+  in.seekg(readValue<uint64_t>(trailer));
+  for (int c = 0; c < numCols; ++c) {
+    Column& column = stats[c];
+    column.loaded = false;
+    for (int chunk = 0; chunk < table->numChunks; ++chunk) {
+      uint64_t offset = readValue<uint64_t>(in);
+      uint64_t size = readValue<uint64_t>(in);
+      if (offset + size > file->size())
+        throw runtime_error("Corrupted encrypted table file " + path);
+      column.segments.emplace_back(offset, size);
+    }
+    table->columns.emplace(names[c], move(column));
+  }
+
+  return table;
+}
+
+void EncryptedTable::loadColumn(Column& column) const
+{
+  HELAYERS_TIMER("load column");
+  column.chunks.assign(numChunks, CTile(he));
+#pragma omp parallel for
+  for (int chunk = 0; chunk < numChunks; ++chunk) {
+    const auto& [offset, size] = column.segments[chunk];
+    MemoryStream in(mappedFile->data() + offset, size);
+    column.chunks[chunk].load(in);
+  }
+  column.loaded = true;
+}
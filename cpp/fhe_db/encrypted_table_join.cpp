@@ -0,0 +1,180 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Equi-joins of EncryptedTable.
+//
+// Slot i of a chunk of the other table, rotated by r, holds its row i + r, so
+// comparing a chunk of this table for equality with all the rotations of a
+// chunk of the other table compares every pair of their rows exactly once.
+// The validity of the other chunk is known to the server, so it is rotated in
+// the clear and multiplied as a plaintext, and padding and deleted rows never
+// match. A join of n by m rows takes about (n / slots) * (m / slots) * slots
+// equality comparisons: with 16384 slots, a 100K by 10K join takes 7 chunks
+// times 16384 rotations, about 115K equality evaluations.
+
+#include <omp.h>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+vector<CTile> EncryptedTable::joinMatches(const string& keyColumn,
+                                          const EncryptedTable& other,
+                                          const string& otherKeyColumn) const
+{
+  if (&other.he != &he)
+    throw runtime_error("Joined tables must share the same HE context");
+  if (numRows == 0 || other.numRows == 0)
+    throw runtime_error("Joined tables must not be empty");
+
+  const Column& key = getColumn(keyColumn);
+  const Column& otherKey = other.getColumn(otherKeyColumn);
+
+  // The comparison covers the values of both keys, in the scale of this one
+  Column joinKey;
+  joinKey.scale = key.scale;
+  joinKey.minVal = min(key.minVal, otherKey.minVal);
+  joinKey.maxVal = max(key.maxVal, otherKey.maxVal);
+  CompareMethod method = planComparison(joinKey, IS_EQUAL).method;
+
+  // A single chunk of the other table that fits in half the slots is
+  // replicated, so rotating it through a segment covers all its rows.
+  int period = numSlots;
+  if (other.numChunks == 1)
+    while (period / 2 >= other.numRows)
+      period /= 2;
+
+  // The keys of the other table in the scale of this one, and their
+  // validity, both replicated with the period
+  vector<CTile> otherKeys(other.numChunks, CTile(he));
+  vector<vector<double>> otherValid(other.numChunks,
+                                    vector<double>(numSlots, 0));
+#pragma omp parallel for
+  for (int chunk = 0; chunk < other.numChunks; ++chunk) {
+    otherKeys[chunk] = period < numSlots
+                           ? other.getReplicatedColumn(otherKeyColumn, period)
+                           : otherKey.chunks[chunk];
+    if (otherKey.scale != key.scale)
+      otherKeys[chunk].multiplyScalar(otherKey.scale / key.scale);
+
+    for (int slot = 0; slot < numSlots; ++slot) {
+      int row = chunk * numSlots + slot % period;
+      otherValid[chunk][slot] = row < other.numRows && !other.deleted[row];
+    }
+  }
+
+  // Every thread accumulates the matches of its rotations for all the chunks
+  // of this table, and the threads are then summed
+  int numTasks = other.numChunks * period;
+  int numThreads = max(1, min(numTasks, omp_get_max_threads()));
+  vector<vector<optional<CTile>>> partials(
+      numThreads, vector<optional<CTile>>(numChunks));
+
+#pragma omp parallel num_threads(numThreads)
+  {
+    HELAYERS_TIMER("join thread");
+    vector<optional<CTile>>& partial = partials[omp_get_thread_num()];
+
+#pragma omp for schedule(dynamic)
+    for (int task = 0; task < numTasks; ++task) {
+      int otherChunk = task / period;
+      int rot = task % period;
+      CTile rotatedKeys = otherKeys[otherChunk];
+      if (rot != 0)
+        rotatedKeys.rotate(rot);
+      const vector<double>& valid = otherValid[otherChunk];
+      vector<double> rotated(numSlots);
+      for (int slot = 0; slot < numSlots; ++slot)
+        rotated[slot] = valid[(slot + rot) % numSlots];
+      PTile rotatedValid(he);
+      enc.encode(rotatedValid, rotated);
+      for (int chunk = 0; chunk < numChunks; ++chunk) {
+        CTile eq = compareColumn(
+            key.chunks[chunk], rotatedKeys, joinKey, IS_EQUAL, method);
+        eq.multiplyPlain(rotatedValid);
+        accumulate(partial[chunk], eq);
+      }
+    }
+  }
+
+  vector<CTile> matches(numChunks, CTile(he));
+#pragma omp parallel for
+  for (int chunk = 0; chunk < numChunks; ++chunk) {
+    optional<CTile> sum;
+    for (vector<optional<CTile>>& partial : partials)
+      if (partial[chunk].has_value())
+        accumulate(sum, *partial[chunk]);
+    matches[chunk] = move(*sum);
+    const PTile* valid = getValidity(chunk);
+    if (valid != nullptr)
+      matches[chunk].multiplyPlain(*valid);
+  }
+  return matches;
+}
+
+MultiAggregateResult EncryptedTable::joinQuery(
+    const string& keyColumn,
+    const EncryptedTable& other,
+    const string& otherKeyColumn,
+    const vector<Aggregate>& aggregates) const
+{
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(aggregates, needCount, needSumOfSquares);
+  for (const auto& [colName, withSquares] : needSumOfSquares)
+    getColumn(colName);
+
+  vector<CTile> matches = joinMatches(keyColumn, other, otherKeyColumn);
+
+  vector<PartialSums> partials(numChunks);
+#pragma omp parallel for
+  for (int chunk = 0; chunk < numChunks; ++chunk) {
+    PartialSums& partial = partials[chunk];
+    const CTile& mask = matches[chunk];
+    if (needCount)
+      partial.count = mask;
+    for (const auto& [colName, withSquares] : needSumOfSquares) {
+      const CTile& x = getColumn(colName).chunks[chunk];
+      CTile masked = mask;
+      masked.multiply(x);
+      partial.sums[colName] = masked;
+      if (withSquares) {
+        masked.multiply(x);
+        partial.sumsOfSquares[colName] = masked;
+      }
+    }
+  }
+  reducePartialSums(partials);
+
+  PartialSums& total = partials[0];
+  MultiAggregateResult res;
+  res.aggregates = aggregates;
+  res.count = move(total.count);
+  for (auto& [colName, sum] : total.sums)
+    res.sums.emplace(colName, move(*sum));
+  for (auto& [colName, sumOfSquares] : total.sumsOfSquares)
+    res.sumsOfSquares.emplace(colName, move(*sumOfSquares));
+  return res;
+}
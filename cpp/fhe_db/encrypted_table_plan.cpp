@@ -0,0 +1,185 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Query planning of EncryptedTable.
+//
+// The cost model counts ciphertext multiplications and multiplication depth.
+// FunctionEvaluator::compare() evaluates composite polynomials of degree 3,
+// each taking about two multiplications and two levels, after normalizing
+// the difference by maxDiff. Equality over a small range of values can
+// instead be computed as a product of 1 - d^2/j^2 over the possible nonzero
+// differences j, which is exact on integers and much shallower, but whose
+// intermediate products grow quickly with the range.
+
+#include <chrono>
+#include <cmath>
+#include <omp.h>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+// The indicator polynomial is considered for ranges of up to maxIndicatorRange
+// values, whose intermediate products stay below maxIndicatorMagnitude, well
+// within the integer precision of the scheme.
+static const int maxIndicatorRange = 16;
+static const double maxIndicatorMagnitude = 256;
+
+// Returns a bound on the magnitude of any partial product of the indicator
+// polynomial over a range of values.
+static double indicatorMagnitude(int range)
+{
+  double res = 1;
+  for (int d = 0; d <= range; ++d) {
+    double bound = 1;
+    for (int j = 1; j <= range; ++j)
+      bound *= max(1.0, fabs(1 - (double)d * d / (j * j)));
+    res = max(res, bound);
+  }
+  return res;
+}
+
+PredicatePlan EncryptedTable::planPredicate(const Predicate& predicate) const
+{
+  PredicatePlan plan = planComparison(getColumn(predicate.column, false),
+                                      predicate.comparisonType);
+  plan.column = predicate.column;
+  return plan;
+}
+
+PredicatePlan EncryptedTable::planComparison(
+    const Column& column,
+    ComparisonType comparisonType) const
+{
+  PredicatePlan plan;
+  plan.comparisonType = comparisonType;
+  plan.method = CMP_SIGN;
+  CompareConfig config = columnCompareConfig(column);
+  int iterations = config.gRep + config.fRep;
+  plan.depth = 2 * iterations + 2;
+  plan.multiplications = 2 * iterations;
+  if (comparisonType != IS_EQUAL)
+    return plan;
+
+  // 4c(1-c) turns the comparison into equality
+  plan.depth++;
+  plan.multiplications++;
+
+  // The compare value is clamped to one step outside the column's range, so
+  // the difference is at most the number of values in it.
+  int range = compareRange(column);
+  if (range > maxIndicatorRange ||
+      indicatorMagnitude(range) > maxIndicatorMagnitude)
+    return plan;
+  int depth = 2 + ceil(log2(range));
+  int multiplications = range;
+  if (depth + multiplications < plan.depth + plan.multiplications) {
+    plan.method = CMP_INDICATOR;
+    plan.depth = depth;
+    plan.multiplications = multiplications;
+  }
+  return plan;
+}
+
+CTile EncryptedTable::indicatorMask(const CTile& x,
+                                    const CTile& val,
+                                    const Column& column) const
+{
+  CTile squaredDiff = x;
+  squaredDiff.sub(val);
+  squaredDiff.square();
+
+  int range = compareRange(column);
+  double scale2 = column.scale * column.scale;
+  vector<CTile> factors;
+  for (int j = 1; j <= range; ++j) {
+    CTile factor = squaredDiff;
+    factor.multiplyScalar(-scale2 / (j * j));
+    factor.addScalar(1);
+    factors.push_back(move(factor));
+  }
+  return multiplyBalanced(factors);
+}
+
+void EncryptedTable::measureMultiplyTime() const
+{
+  const int repeats = 8;
+  CTile c(he);
+  enc.encodeEncrypt(c, vector<double>(numSlots, 1));
+  auto start = chrono::high_resolution_clock::now();
+  for (int i = 0; i < repeats; ++i) {
+    CTile tmp = c;
+    tmp.multiply(c);
+  }
+  chrono::duration<double> elapsed =
+      chrono::high_resolution_clock::now() - start;
+  multiplySec = elapsed.count() / repeats;
+}
+
+QueryPlan EncryptedTable::planQuery(const Condition& condition,
+                                    const vector<Aggregate>& aggregates) const
+{
+  call_once(multiplyTimeOnce, [this]() { measureMultiplyTime(); });
+
+  QueryPlan plan;
+  vector<const Predicate*> predicates;
+  condition.getPredicates(predicates);
+  int predicateDepth = 0;
+  int perChunk = 0;
+  for (const Predicate* pred : predicates) {
+    PredicatePlan predPlan = planPredicate(*pred);
+    // A cached mask still carries the depth it was computed with
+    if (maskCache.isEnabled() &&
+        maskCache.contains(
+            MaskKey(pred->column, pred->comparisonType, pred->compareValue))) {
+      predPlan.method = CMP_CACHED;
+      predPlan.multiplications = 0;
+    }
+    predicateDepth = max(predicateDepth, predPlan.depth);
+    perChunk += predPlan.multiplications;
+    plan.predicates.push_back(predPlan);
+  }
+  plan.combineDepth = condition.getCombineDepth();
+  plan.combineMultiplications = condition.getCombineMultiplications();
+
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(aggregates, needCount, needSumOfSquares);
+  for (const auto& [colName, withSquares] : needSumOfSquares) {
+    plan.aggregateDepth = max(plan.aggregateDepth, withSquares ? 2 : 1);
+    plan.aggregateMultiplications += withSquares ? 2 : 1;
+  }
+  perChunk += plan.combineMultiplications + plan.aggregateMultiplications;
+
+  // Multiplying by the validity of a chunk takes another level
+  plan.depth = predicateDepth + plan.combineDepth + plan.aggregateDepth +
+               (validity.empty() ? 0 : 1);
+  plan.numChunks = numChunks;
+  plan.numThreads = max(1, min(numChunks, omp_get_max_threads()));
+  plan.multiplications = (long)perChunk * numChunks;
+  plan.predictedLatencySec =
+      plan.multiplications * multiplySec / plan.numThreads;
+  return plan;
+}
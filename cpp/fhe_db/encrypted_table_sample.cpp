@@ -0,0 +1,250 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Sampled queries of EncryptedTable.
+//
+// The server visits the chunks in a random order, and packs the partial sums
+// of every visited chunk in its own slot. The client scales the sum of the
+// sampled chunks up to the whole table, and bootstraps the standard error of
+// every aggregate by resampling the sampled chunks.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+// The number of resamples of the bootstrapped standard error
+static const int numResamples = 200;
+
+SampledQueryResult EncryptedTable::sampledQuery(
+    const Condition& condition,
+    const vector<Aggregate>& aggregates,
+    int numSampleChunks,
+    unsigned int seed) const
+{
+  if (numChunks > numSlots)
+    throw runtime_error("Sampled queries support up to " +
+                        to_string(numSlots) + " chunks");
+
+  SampledQueryResult res;
+  res.condition = condition;
+  res.aggregates = aggregates;
+  res.chunkOrder.resize(numChunks);
+  iota(res.chunkOrder.begin(), res.chunkOrder.end(), 0);
+  mt19937 gen(seed);
+  shuffle(res.chunkOrder.begin(), res.chunkOrder.end(), gen);
+
+  refineSampledQuery(res, numSampleChunks);
+  return res;
+}
+
+void EncryptedTable::refineSampledQuery(SampledQueryResult& res,
+                                        int numMoreChunks) const
+{
+  HELAYERS_TIMER("sampled query");
+  int first = res.numSampled;
+  int last = min((int)res.chunkOrder.size(), first + max(numMoreChunks, 0));
+  if (last == first)
+    return;
+
+  bool needCount;
+  map<string, bool> needSumOfSquares;
+  findPartialSums(res.aggregates, needCount, needSumOfSquares);
+
+  // Cached masks are used, but the masks of a sample cover only some of the
+  // chunks, so they are not stored in the cache.
+  ConditionMasks masks = prepareMasks(*res.condition);
+  for (const Predicate* pred : masks.predicates)
+    getColumn(pred->column);
+  for (const auto& [colName, withSquares] : needSumOfSquares)
+    getColumn(colName);
+
+  // The masked values of every chunk are computed first, and then packed
+  // together into the slots of the chunks by a single reduction per
+  // partial sum
+  int n = last - first;
+  vector<CTile> counts(needCount ? n : 0, CTile(he));
+  map<string, vector<CTile>> sums;
+  map<string, vector<CTile>> sumsOfSquares;
+  for (const auto& [colName, withSquares] : needSumOfSquares) {
+    sums[colName].resize(n, CTile(he));
+    if (withSquares)
+      sumsOfSquares[colName].resize(n, CTile(he));
+  }
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i) {
+    int chunk = res.chunkOrder[first + i];
+    CTile mask = evaluateCondition(*res.condition, masks, chunk);
+
+    for (const auto& [colName, withSquares] : needSumOfSquares) {
+      const CTile& x = getColumn(colName).chunks[chunk];
+      CTile& masked = sums.at(colName)[i];
+      masked = mask;
+      masked.multiply(x);
+      if (withSquares) {
+        sumsOfSquares.at(colName)[i] = masked;
+        sumsOfSquares.at(colName)[i].multiply(x);
+      }
+    }
+    if (needCount)
+      counts[i] = move(mask);
+  }
+
+  auto addTo = [](map<string, CTile>& packed,
+                  const string& colName,
+                  const CTile& val) {
+    auto it = packed.find(colName);
+    if (it == packed.end())
+      packed.emplace(colName, val);
+    else
+      it->second.add(val);
+  };
+  if (needCount)
+    accumulate(res.counts, packSums(counts, first));
+  for (const auto& [colName, vals] : sums)
+    addTo(res.sums, colName, packSums(vals, first));
+  for (const auto& [colName, vals] : sumsOfSquares)
+    addTo(res.sumsOfSquares, colName, packSums(vals, first));
+  res.numSampled = last;
+}
+
+// Returns z such that a standard normal variable lies in [-z, z] with the
+// given probability.
+static double normalQuantile(double confidence)
+{
+  double low = 0, high = 10;
+  for (int i = 0; i < 100; ++i) {
+    double mid = (low + high) / 2;
+    if (erf(mid / sqrt(2.0)) < confidence)
+      low = mid;
+    else
+      high = mid;
+  }
+  return (low + high) / 2;
+}
+
+vector<ApproximateAggregate> EncryptedTable::postProcessSampledQuery(
+    const SampledQueryResult& res,
+    double confidence) const
+{
+  int n = res.numSampled;
+  if (n == 0)
+    throw runtime_error("No chunks were sampled");
+  if (confidence <= 0 || confidence >= 1)
+    throw runtime_error("The confidence must be between 0 and 1");
+
+  // The partial sums of every sampled chunk
+  vector<double> counts(n, 0);
+  map<string, vector<double>> sums;
+  map<string, vector<double>> sumsOfSquares;
+  if (res.counts.has_value()) {
+    vector<double> slots = enc.decryptDecodeDouble(*res.counts);
+    for (int i = 0; i < n; ++i)
+      counts[i] = slots[i] * numRows;
+  }
+  for (const auto& [colName, sum] : res.sums) {
+    double scale = getColumn(colName, false).scale;
+    vector<double> slots = enc.decryptDecodeDouble(sum);
+    for (int i = 0; i < n; ++i)
+      sums[colName].push_back(slots[i] * numRows * scale);
+  }
+  for (const auto& [colName, sumOfSquares] : res.sumsOfSquares) {
+    double scale = getColumn(colName, false).scale;
+    vector<double> slots = enc.decryptDecodeDouble(sumOfSquares);
+    for (int i = 0; i < n; ++i)
+      sumsOfSquares[colName].push_back(slots[i] * numRows * scale * scale);
+  }
+
+  // The live rows of every sampled chunk. The last chunk is usually partial,
+  // and chunks may have deleted rows, so they don't all weigh the same.
+  vector<double> rows(n, 0);
+  for (int i = 0; i < n; ++i) {
+    int first = res.chunkOrder[i] * numSlots;
+    for (int row = first; row < min(first + numSlots, numRows); ++row)
+      rows[i] += deleted[row] ? 0 : 1;
+  }
+
+  // Estimates the aggregates from the chunks sampled the given number of
+  // times each, scaled up by the ratio of the live rows of the table to the
+  // live rows of the sample
+  int totalChunks = res.chunkOrder.size();
+  auto estimate = [&](const vector<int>& multiplicity) {
+    double sampledRows = 0;
+    for (int i = 0; i < n; ++i)
+      sampledRows += multiplicity[i] * rows[i];
+    double factor = sampledRows > 0 ? (numRows - numDeleted) / sampledRows : 0;
+    double count = 0;
+    map<string, double> totalSums;
+    map<string, double> totalSumsOfSquares;
+    for (int i = 0; i < n; ++i) {
+      count += factor * multiplicity[i] * counts[i];
+      for (const auto& [colName, vals] : sums)
+        totalSums[colName] += factor * multiplicity[i] * vals[i];
+      for (const auto& [colName, vals] : sumsOfSquares)
+        totalSumsOfSquares[colName] += factor * multiplicity[i] * vals[i];
+    }
+    return deriveAggregates(
+        res.aggregates, count, totalSums, totalSumsOfSquares);
+  };
+
+  vector<double> estimates = estimate(vector<int>(n, 1));
+  size_t numAggregates = res.aggregates.size();
+  vector<double> mean(numAggregates, 0);
+  vector<double> meanOfSquares(numAggregates, 0);
+  mt19937 gen(n);
+  uniform_int_distribution<int> pick(0, n - 1);
+  for (int r = 0; r < numResamples; ++r) {
+    vector<int> multiplicity(n, 0);
+    for (int i = 0; i < n; ++i)
+      multiplicity[pick(gen)]++;
+    vector<double> vals = estimate(multiplicity);
+    for (size_t a = 0; a < numAggregates; ++a) {
+      mean[a] += vals[a] / numResamples;
+      meanOfSquares[a] += vals[a] * vals[a] / numResamples;
+    }
+  }
+
+  double z = normalQuantile(confidence);
+  double finitePopulation = 1 - (double)n / totalChunks;
+  vector<ApproximateAggregate> approx;
+  for (size_t a = 0; a < numAggregates; ++a) {
+    // A single chunk tells nothing about the variance between the chunks
+    if (n < 2 && n < totalChunks) {
+      double inf = numeric_limits<double>::infinity();
+      approx.push_back(ApproximateAggregate{estimates[a], -inf, inf});
+      continue;
+    }
+    double variance = max(meanOfSquares[a] - mean[a] * mean[a], 0.0);
+    double halfWidth = z * sqrt(variance * finitePopulation);
+    approx.push_back(ApproximateAggregate{
+        estimates[a], estimates[a] - halfWidth, estimates[a] + halfWidth});
+  }
+  return approx;
+}
@@ -0,0 +1,155 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Top-K, MIN and MAX queries of EncryptedTable.
+
+#include <cmath>
+
+#include "encrypted_table.h"
+
+using namespace std;
+using namespace helayers;
+
+CTile EncryptedTable::tournamentMatch(const CTile& a,
+                                      const CTile& b,
+                                      bool largest,
+                                      const Column& column) const
+{
+  // c is 1 where a wins, 0 where b wins and 0.5 on a tie, so b + c(a-b) is
+  // the winner
+  CTile c = largest ? compare(a, b, column) : compare(b, a, column);
+  CTile res = a;
+  res.sub(b);
+  res.multiply(c);
+  res.add(b);
+  return res;
+}
+
+CTile EncryptedTable::tournament(vector<CTile> vals,
+                                 bool largest,
+                                 const Column& column) const
+{
+  HELAYERS_TIMER("tournament");
+  // The matches of every round across chunks are played in parallel
+  while (vals.size() > 1) {
+    int n = vals.size();
+    int half = (n + 1) / 2;
+#pragma omp parallel for
+    for (int i = 0; i < n - half; ++i)
+      vals[i] = tournamentMatch(vals[i], vals[i + half], largest, column);
+    vals.resize(half, CTile(he));
+  }
+
+  // Every round across slots plays all the slots at once. The rotations wrap
+  // around, so every slot ends up holding the winner.
+  CTile res = move(vals[0]);
+  for (int rot = 1; rot < numSlots; rot *= 2) {
+    CTile rotated = res;
+    rotated.rotate(rot);
+    res = tournamentMatch(res, rotated, largest, column);
+  }
+  return res;
+}
+
+TopKResult EncryptedTable::topKQuery(const string& column,
+                                     int k,
+                                     bool largest,
+                                     const optional<Condition>& condition) const
+{
+  if (k < 1)
+    throw runtime_error("k must be positive");
+
+  const Column& col = getColumn(column);
+  // A value that loses every match against an actual value
+  double sentinel = (largest ? col.minVal - 1 : col.maxVal + 1) / col.scale;
+
+  optional<ConditionMasks> masks;
+  if (condition.has_value()) {
+    masks = prepareMasks(*condition);
+    for (const Predicate* pred : masks->predicates)
+      getColumn(pred->column);
+  }
+
+  // The values of the rows, with the sentinel in place of rows that don't
+  // match: m(x - s) + s
+  vector<CTile> vals(numChunks, CTile(he));
+#pragma omp parallel for
+  for (int chunk = 0; chunk < numChunks; ++chunk) {
+    CTile& val = vals[chunk];
+    val = col.chunks[chunk];
+    const PTile* valid = getValidity(chunk);
+    if (!condition.has_value() && valid == nullptr)
+      continue;
+    val.addScalar(-sentinel);
+    if (condition.has_value())
+      val.multiply(evaluateCondition(*condition, *masks, chunk));
+    else
+      val.multiplyPlain(*valid);
+    val.addScalar(sentinel);
+  }
+  if (masks.has_value())
+    storeMasks(*masks);
+
+  TopKResult res;
+  res.column = column;
+  res.largest = largest;
+  for (int i = 0; i < k; ++i) {
+    res.values.push_back(tournament(vals, largest, col));
+    if (i + 1 == k)
+      break;
+
+    // Knock the winner out by replacing it with the sentinel: x + m(s - x).
+    // The winner is approximate, but no remaining value lies beyond it and
+    // the values are integers, so the rows that hold it are exactly those
+    // within half a step of it. The threshold lies between integers, where
+    // the comparison is far from a tie, so it goes to compare() as is:
+    // compareColumn() would shift it by another half step, onto an integer.
+    CTile threshold = res.values.back();
+    threshold.addScalar((largest ? -0.5 : 0.5) / col.scale);
+#pragma omp parallel for
+    for (int chunk = 0; chunk < numChunks; ++chunk) {
+      CTile m = largest ? compare(vals[chunk], threshold, col)
+                        : compare(threshold, vals[chunk], col);
+      CTile diff = vals[chunk];
+      diff.negate();
+      diff.addScalar(sentinel);
+      m.multiply(diff);
+      vals[chunk].add(m);
+    }
+  }
+  return res;
+}
+
+vector<double> EncryptedTable::postProcessTopKQuery(const TopKResult& res) const
+{
+  const Column& col = getColumn(res.column, false);
+  vector<double> vals;
+  for (const CTile& c : res.values) {
+    // The column holds integers, so rounding removes the approximation error
+    double val = round(enc.decryptDecodeDouble(c).at(0) * col.scale);
+    bool isSentinel = res.largest ? val < col.minVal : val > col.maxVal;
+    vals.push_back(isSentinel ? NAN : val);
+  }
+  return vals;
+}
@@ -0,0 +1,390 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "helayers/hebase/hebase.h"
+#include "encrypted_table.h"
+#include "fhe_db_utils.h"
+
+using namespace std;
+using namespace helayers;
+
+/*
+A benchmark of the EncryptedTable query engine over synthetic tables. For
+every table size and integer bit width, a table with a "key" and a "value"
+column of uniformly random integers is encrypted, and every aggregate is
+queried with every comparison type against the middle of the key range. The
+latency percentiles of every combination are written as JSON and/or CSV,
+along with the number of ciphertexts, the planned depth and the peak RAM.
+*/
+
+// Benchmark options
+vector<int> tableRows = {10000, 100000, 1000000, 10000000};
+vector<int> bitWidths = {8, 11, 16};
+int repeats = 5;
+unsigned int seed = 1;
+string jsonPath = "";
+string csvPath = "";
+
+// Comparison accuracy options
+CompareConfig compareConfig;
+
+// Context options
+bool mockupContext = false;
+int numSlots = 16384;
+int multiplicationDepth = 20;
+int fractionalPartPrecision = 42;
+int integerPartPrecision = 10;
+
+const vector<ComparisonType> comparisonTypes = {IS_EQUAL,
+                                                IS_GREATER,
+                                                IS_SMALLER,
+                                                IS_GREATER_EQUAL,
+                                                IS_SMALLER_EQUAL};
+
+const vector<AggregateType> aggregateTypes = {
+    AGG_COUNT, AGG_SUM, AGG_AVG, AGG_STDDEV};
+
+// The measurements of one aggregate and comparison type over one table.
+struct BenchmarkResult
+{
+  int rows;
+  int bits;
+  int chunks;
+  int ciphertexts;
+  double encryptSec;
+  string comparison;
+  string aggregate;
+  int depth;
+  long multiplications;
+  double predictedSec;
+  double minSec;
+  double meanSec;
+  double p50Sec;
+  double p90Sec;
+  double p99Sec;
+  double maxSec;
+  double maxRelativeError;
+  int peakRamMb;
+};
+
+void help()
+{
+  cout << "Usage: ./fhe_db_benchmark [ additional optional parameters ]"
+       << endl;
+  cout << endl;
+  cout << "Benchmark options:" << endl;
+  cout << "--rows n1,n2,...\tthe table sizes to benchmark." << endl;
+  cout << "--bits b1,b2,...\tthe integer bit widths of the table values."
+       << endl;
+  cout << "--repeats n\tthe number of times every query is run." << endl;
+  cout << "--seed n\tthe seed of the synthetic tables." << endl;
+  cout << "--json path\twrites the results as JSON." << endl;
+  cout << "--csv path\twrites the results as CSV." << endl;
+  cout << endl;
+  cout << "Comparison accuracy options:" << endl;
+  cout << "--g_rep n\tcontrols the accuracy (and depth) of the comparison."
+       << endl;
+  cout << "--f_rep n\tcontrols the accuracy (and depth) of the comparison."
+       << endl;
+  cout << "--fixed_compare\tuses g_rep for every column, instead of adapting "
+          "it to the bit width of the column's range."
+       << endl;
+  cout << endl;
+  cout << "Context options:" << endl;
+  cout << "--mockup\truns the benchmark with a mockup context, for fast "
+          "parameter sweeps."
+       << endl;
+  cout << "--slots n\tsets the number of slots in the HE context." << endl;
+  cout << "--depth n\tsets the multiplication depth in the HE context." << endl;
+  cout << "--frac n\tsets the fractional precision in the HE context." << endl;
+  cout << "--int n\tsets the integer precision in the HE context." << endl;
+  exit(1);
+}
+
+vector<int> parseList(const string& str)
+{
+  vector<int> res;
+  stringstream ss(str);
+  string item;
+  while (getline(ss, item, ','))
+    res.push_back(stoi(item));
+  return res;
+}
+
+string aggregateTypeToStr(AggregateType type)
+{
+  switch (type) {
+  case AGG_COUNT:
+    return "COUNT";
+  case AGG_SUM:
+    return "SUM";
+  case AGG_AVG:
+    return "AVG";
+  case AGG_STDDEV:
+    return "STDDEV";
+  default:
+    always_assert(false);
+    return "";
+  }
+}
+
+PlainTable generateTable(int rows, int bits, mt19937& gen)
+{
+  uniform_int_distribution<int> dist(0, (1 << bits) - 1);
+  PlainTable table;
+  table.columnNames = {"key", "value"};
+  table.columns.assign(2, vector<double>(rows));
+  for (vector<double>& col : table.columns)
+    for (double& v : col)
+      v = dist(gen);
+  return table;
+}
+
+double plainAggregate(const PlainTable& table,
+                      double val,
+                      ComparisonType comparisonType,
+                      AggregateType type)
+{
+  const vector<double>& keys = table.getColumn("key");
+  const vector<double>& vals = table.getColumn("value");
+  double count = 0, sum = 0, sumOfSquares = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (!plainMatch(keys[i], val, comparisonType))
+      continue;
+    count++;
+    sum += vals[i];
+    sumOfSquares += vals[i] * vals[i];
+  }
+  double avg = sum / count;
+  switch (type) {
+  case AGG_COUNT:
+    return count;
+  case AGG_SUM:
+    return sum;
+  case AGG_AVG:
+    return avg;
+  case AGG_STDDEV:
+    return sqrt(max(sumOfSquares / count - avg * avg, 0.0));
+  default:
+    always_assert(false);
+    return 0;
+  }
+}
+
+// Returns the p-th percentile of sorted latencies, by the nearest rank.
+double percentile(const vector<double>& sorted, double p)
+{
+  int rank = ceil(p / 100 * sorted.size());
+  return sorted[max(rank, 1) - 1];
+}
+
+void benchmarkTable(HeContext& he,
+                    int rows,
+                    int bits,
+                    mt19937& gen,
+                    vector<BenchmarkResult>& results)
+{
+  cout << "Benchmarking " << rows << " rows of " << bits << " bit values"
+       << endl;
+  PlainTable plain = generateTable(rows, bits, gen);
+
+  auto start = chrono::high_resolution_clock::now();
+  EncryptedTable table(he, plain, compareConfig);
+  chrono::duration<double> encryptTime =
+      chrono::high_resolution_clock::now() - start;
+
+  double compareValPlain = 1 << (bits - 1);
+  for (ComparisonType comparisonType : comparisonTypes) {
+    Predicate pred{"key",
+                   comparisonType,
+                   table.createCompareValue(compareValPlain, "key")};
+    for (AggregateType type : aggregateTypes) {
+      vector<Aggregate> aggregates = {{type, "value"}};
+      double expected =
+          plainAggregate(plain, compareValPlain, comparisonType, type);
+
+      BenchmarkResult res;
+      res.rows = rows;
+      res.bits = bits;
+      res.chunks = table.getNumChunks();
+      res.ciphertexts = table.getNumChunks() * table.getColumnNames().size();
+      res.encryptSec = encryptTime.count();
+      res.comparison = compTypeToStr(comparisonType);
+      res.aggregate = aggregateTypeToStr(type);
+      QueryPlan plan = table.planQuery(pred, aggregates);
+      res.depth = plan.depth;
+      res.multiplications = plan.multiplications;
+      res.predictedSec = plan.predictedLatencySec;
+      res.maxRelativeError = 0;
+
+      vector<double> latencies;
+      for (int r = 0; r < repeats; ++r) {
+        auto start = chrono::high_resolution_clock::now();
+        MultiAggregateResult encRes = table.multiAggregateQuery(pred,
+                                                                aggregates);
+        chrono::duration<double> latency =
+            chrono::high_resolution_clock::now() - start;
+        latencies.push_back(latency.count());
+
+        double val = table.postProcessMultiAggregateQuery(encRes)[0];
+        res.maxRelativeError =
+            max(res.maxRelativeError,
+                fabs(val - expected) / max(1.0, fabs(expected)));
+      }
+
+      sort(latencies.begin(), latencies.end());
+      res.minSec = latencies.front();
+      res.maxSec = latencies.back();
+      res.meanSec = 0;
+      for (double latency : latencies)
+        res.meanSec += latency / latencies.size();
+      res.p50Sec = percentile(latencies, 50);
+      res.p90Sec = percentile(latencies, 90);
+      res.p99Sec = percentile(latencies, 99);
+      res.peakRamMb = getPeakRamMb();
+
+      cout << "  " << res.aggregate << " WHERE key " << res.comparison
+           << ": p50 " << res.p50Sec << " s, p99 " << res.p99Sec
+           << " s, relative error " << res.maxRelativeError << endl;
+      results.push_back(res);
+    }
+  }
+}
+
+void writeJson(const string& path, const vector<BenchmarkResult>& results)
+{
+  ofstream out(path);
+  if (!out.is_open())
+    throw runtime_error("Failed to open " + path);
+  out << "[" << endl;
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchmarkResult& r = results[i];
+    out << "  {\"rows\": " << r.rows << ", \"bits\": " << r.bits
+        << ", \"slots\": " << numSlots << ", \"mockup\": "
+        << (mockupContext ? "true" : "false") << ", \"chunks\": " << r.chunks
+        << ", \"ciphertexts\": " << r.ciphertexts
+        << ", \"encrypt_sec\": " << r.encryptSec << ", \"comparison\": \""
+        << r.comparison << "\", \"aggregate\": \"" << r.aggregate
+        << "\", \"depth\": " << r.depth
+        << ", \"multiplications\": " << r.multiplications
+        << ", \"predicted_sec\": " << r.predictedSec
+        << ", \"repeats\": " << repeats << ", \"min_sec\": " << r.minSec
+        << ", \"mean_sec\": " << r.meanSec << ", \"p50_sec\": " << r.p50Sec
+        << ", \"p90_sec\": " << r.p90Sec << ", \"p99_sec\": " << r.p99Sec
+        << ", \"max_sec\": " << r.maxSec
+        << ", \"max_relative_error\": " << r.maxRelativeError
+        << ", \"peak_ram_mb\": " << r.peakRamMb << "}"
+        << (i + 1 < results.size() ? "," : "") << endl;
+  }
+  out << "]" << endl;
+}
+
+void writeCsv(const string& path, const vector<BenchmarkResult>& results)
+{
+  ofstream out(path);
+  if (!out.is_open())
+    throw runtime_error("Failed to open " + path);
+  out << "rows,bits,slots,mockup,chunks,ciphertexts,encrypt_sec,comparison,"
+         "aggregate,depth,multiplications,predicted_sec,repeats,min_sec,"
+         "mean_sec,p50_sec,p90_sec,p99_sec,max_sec,max_relative_error,"
+         "peak_ram_mb"
+      << endl;
+  for (const BenchmarkResult& r : results)
+    out << r.rows << "," << r.bits << "," << numSlots << "," << mockupContext
+        << "," << r.chunks << "," << r.ciphertexts << "," << r.encryptSec
+        << "," << r.comparison << "," << r.aggregate << "," << r.depth << ","
+        << r.multiplications << "," << r.predictedSec << "," << repeats << ","
+        << r.minSec << "," << r.meanSec << "," << r.p50Sec << "," << r.p90Sec
+        << "," << r.p99Sec << "," << r.maxSec << "," << r.maxRelativeError
+        << "," << r.peakRamMb << endl;
+}
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--rows")
+      tableRows = parseList(argv[++i]);
+    else if (string(argv[i]) == "--bits")
+      bitWidths = parseList(argv[++i]);
+    else if (string(argv[i]) == "--repeats")
+      repeats = atoi(argv[++i]);
+    else if (string(argv[i]) == "--seed")
+      seed = atoi(argv[++i]);
+    else if (string(argv[i]) == "--json")
+      jsonPath = argv[++i];
+    else if (string(argv[i]) == "--csv")
+      csvPath = argv[++i];
+    else if (string(argv[i]) == "--g_rep")
+      compareConfig.gRep = atoi(argv[++i]);
+    else if (string(argv[i]) == "--f_rep")
+      compareConfig.fRep = atoi(argv[++i]);
+    else if (string(argv[i]) == "--fixed_compare")
+      compareConfig.adaptive = false;
+    else if (string(argv[i]) == "--mockup")
+      mockupContext = true;
+    else if (string(argv[i]) == "--slots")
+      numSlots = atoi(argv[++i]);
+    else if (string(argv[i]) == "--depth")
+      multiplicationDepth = atoi(argv[++i]);
+    else if (string(argv[i]) == "--frac")
+      fractionalPartPrecision = atoi(argv[++i]);
+    else if (string(argv[i]) == "--int")
+      integerPartPrecision = atoi(argv[++i]);
+    else {
+      cout << "Unsupported argument: " << argv[i] << endl;
+      help();
+    }
+  }
+  if (repeats < 1)
+    help();
+  for (int bits : bitWidths)
+    if (bits < 1 || bits > 30)
+      help();
+
+  shared_ptr<HeContext> he = initContext(numSlots,
+                                         multiplicationDepth,
+                                         fractionalPartPrecision,
+                                         integerPartPrecision,
+                                         mockupContext);
+  he->printSignature(cout);
+
+  mt19937 gen(seed);
+  vector<BenchmarkResult> results;
+  for (int rows : tableRows)
+    for (int bits : bitWidths)
+      benchmarkTable(*he, rows, bits, gen, results);
+
+  if (!jsonPath.empty())
+    writeJson(jsonPath, results);
+  if (!csvPath.empty())
+    writeCsv(csvPath, results);
+}
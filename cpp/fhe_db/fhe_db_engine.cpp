@@ -0,0 +1,701 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <functional>
+#include <set>
+
+#include "helayers/hebase/hebase.h"
+#include "encrypted_table.h"
+#include "fhe_db_utils.h"
+
+using namespace std;
+using namespace helayers;
+
+/*
+The example demonstrates the EncryptedTable query engine, which evaluates a
+predicate once and derives several aggregates from the resulting encrypted
+mask. A "dashboard" of 8 aggregates over two predicates costs two encrypted
+comparisons per chunk, instead of one comparison per aggregate.
+*/
+
+// Table options
+string tablePath = getDataSetsDir() + "/db/txsmillion11Bits.csv";
+int maxRows = -1;
+int blockRows = 1 << 17;
+string tableDir = "";
+string opCol = "tx_sum";
+string compareCol = "client_id";
+
+// Comparison accuracy options
+CompareConfig compareConfig;
+double tolerance = 0.01;
+
+// Query engine options
+size_t maskCacheMb = 1024;
+
+// Context options
+bool mockupContext = false;
+int numSlots = 16384;
+int multiplicationDepth = 20;
+int fractionalPartPrecision = 42;
+int integerPartPrecision = 10;
+bool reportAllTimers = false;
+
+void help()
+{
+  cout << "Usage: ./fhe_db_engine [ additional optional parameters ]" << endl;
+  cout << endl;
+  cout << "Table options:" << endl;
+  cout << "--table path\tthe CSV table to encrypt." << endl;
+  cout << "--rows n\tuse only the first n rows of the table." << endl;
+  cout << "--block_rows n\tthe number of rows read and encrypted together "
+          "while streaming the table."
+       << endl;
+  cout << "--table_dir path\ta directory to save the encrypted table and HE "
+          "context to, or to load them from if they were already saved there."
+       << endl;
+  cout << endl;
+  cout << "Comparison accuracy options:" << endl;
+  cout << "--g_rep n\tcontrols the accuracy (and depth) of the comparison."
+       << endl;
+  cout << "--f_rep n\tcontrols the accuracy (and depth) of the comparison."
+       << endl;
+  cout << "--g_rep_bits n\tthe bit width of the column range g_rep is tuned "
+          "for."
+       << endl;
+  cout << "--fixed_compare\tuses g_rep for every column, instead of adapting "
+          "it to the bit width of the column's range."
+       << endl;
+  cout << "--tolerance x\tthe allowed relative error of the results." << endl;
+  cout << endl;
+  cout << "Query engine options:" << endl;
+  cout << "--cache_mb n\tthe memory budget of the predicate mask cache in MB "
+          "(0 disables it)."
+       << endl;
+  cout << endl;
+  cout << "Context options:" << endl;
+  cout << "--mockup\truns the example with a mockup context for simulation."
+       << endl;
+  cout << "--slots n\tsets the number of slots in the HE context." << endl;
+  cout << "--depth n\tsets the multiplication depth in the HE context." << endl;
+  cout << "--frac n\tsets the fractional precision in the HE context." << endl;
+  cout << "--int n\tsets the integer precision in the HE context." << endl;
+  cout << "--timers \tprints all timers at the end of the example." << endl;
+  exit(1);
+}
+
+string aggregateToStr(const Aggregate& agg)
+{
+  switch (agg.type) {
+  case AGG_COUNT:
+    return "COUNT *";
+  case AGG_SUM:
+    return "SUM " + agg.column;
+  case AGG_AVG:
+    return "AVG " + agg.column;
+  case AGG_STDDEV:
+    return "STDDEV " + agg.column;
+  default:
+    always_assert(false);
+    return "";
+  }
+}
+
+// Computes the aggregates over the rows that match, in the clear, for
+// verification.
+vector<double> plainMultiAggregateQuery(const PlainTable& table,
+                                        const function<bool(size_t)>& match,
+                                        const vector<Aggregate>& aggregates)
+{
+  size_t numRows = table.columns[0].size();
+  vector<double> res;
+  for (const Aggregate& agg : aggregates) {
+    double count = 0, sum = 0, sumOfSquares = 0;
+    for (size_t i = 0; i < numRows; ++i) {
+      if (!match(i))
+        continue;
+      count++;
+      if (agg.type != AGG_COUNT) {
+        double x = table.getColumn(agg.column)[i];
+        sum += x;
+        sumOfSquares += x * x;
+      }
+    }
+    double avg = sum / count;
+    switch (agg.type) {
+    case AGG_COUNT:
+      res.push_back(count);
+      break;
+    case AGG_SUM:
+      res.push_back(sum);
+      break;
+    case AGG_AVG:
+      res.push_back(avg);
+      break;
+    case AGG_STDDEV:
+      res.push_back(sqrt(sumOfSquares / count - avg * avg));
+      break;
+    }
+  }
+  return res;
+}
+
+vector<double> plainMultiAggregateQuery(const PlainTable& table,
+                                        const string& col,
+                                        double val,
+                                        ComparisonType comparisonType,
+                                        const vector<Aggregate>& aggregates)
+{
+  const vector<double>& compareVals = table.getColumn(col);
+  return plainMultiAggregateQuery(
+      table,
+      [&](size_t i) { return plainMatch(compareVals[i], val, comparisonType); },
+      aggregates);
+}
+
+void verify(const vector<Aggregate>& aggregates,
+            const vector<double>& vals,
+            const vector<double>& expected)
+{
+  for (size_t i = 0; i < aggregates.size(); ++i) {
+    cout << fixed << "  " << aggregateToStr(aggregates[i])
+         << " result: " << vals[i] << " expected: " << expected[i] << endl;
+    always_assert(fabs(vals[i] - expected[i]) <=
+                  tolerance * max(1.0, fabs(expected[i])));
+  }
+}
+
+const vector<Aggregate> dashboard = {{AGG_COUNT, ""},
+                                     {AGG_SUM, opCol},
+                                     {AGG_AVG, opCol},
+                                     {AGG_STDDEV, opCol}};
+
+// Computes all the dashboard aggregates in a single query.
+void runDashboard(const EncryptedTable& t,
+                  const PlainTable& plain,
+                  const Predicate& pred,
+                  double compareValPlain)
+{
+  string compType = compTypeToStr(pred.comparisonType);
+  cout << "WHERE " << pred.column << " " << compType << " " << compareValPlain
+       << endl;
+
+  t.planQuery(pred, dashboard).print(cout);
+
+  HELAYERS_TIMER_PUSH("multi aggregate query " + compType);
+  MultiAggregateResult res = t.multiAggregateQuery(pred, dashboard);
+  HELAYERS_TIMER_POP();
+
+  HELAYERS_TIMER_PUSH("decrypt multi aggregate query " + compType);
+  vector<double> vals = t.postProcessMultiAggregateQuery(res);
+  HELAYERS_TIMER_POP();
+
+  verify(dashboard,
+         vals,
+         plainMultiAggregateQuery(plain,
+                                  pred.column,
+                                  compareValPlain,
+                                  pred.comparisonType,
+                                  dashboard));
+}
+
+// Computes the dashboard aggregates one query at a time, the way an analyst
+// would. When the mask cache is enabled, only the first of them evaluates the
+// predicate.
+void runSeparateQueries(const EncryptedTable& t,
+                        const PlainTable& plain,
+                        const Predicate& pred,
+                        double compareValPlain)
+{
+  string compType = compTypeToStr(pred.comparisonType);
+  cout << "WHERE " << pred.column << " " << compType << " " << compareValPlain
+       << " (separate queries)" << endl;
+
+  for (const Aggregate& agg : dashboard) {
+    HELAYERS_TIMER_PUSH("separate query " + compType);
+    MultiAggregateResult res = t.multiAggregateQuery(pred, {agg});
+    HELAYERS_TIMER_POP();
+    verify({agg},
+           t.postProcessMultiAggregateQuery(res),
+           plainMultiAggregateQuery(plain,
+                                    pred.column,
+                                    compareValPlain,
+                                    pred.comparisonType,
+                                    {agg}));
+  }
+}
+
+// Runs "WHERE <compareCol> BETWEEN low AND high AND <opCol> > opMin" as a
+// single compound condition.
+void runCompoundQuery(const EncryptedTable& t,
+                      const PlainTable& plain,
+                      int low,
+                      int high,
+                      int opMin)
+{
+  cout << "WHERE " << compareCol << " BETWEEN " << low << " AND " << high
+       << " AND " << opCol << " IS_GREATER " << opMin << endl;
+
+  HELAYERS_TIMER_PUSH("creating compare values");
+  Condition cond = Condition::allOf(
+      {Condition::between(compareCol,
+                          t.createCompareValue(low, compareCol),
+                          t.createCompareValue(high, compareCol)),
+       Predicate{opCol, IS_GREATER, t.createCompareValue(opMin, opCol)}});
+  HELAYERS_TIMER_POP();
+  t.planQuery(cond, dashboard).print(cout);
+
+  HELAYERS_TIMER_PUSH("compound query");
+  MultiAggregateResult res = t.multiAggregateQuery(cond, dashboard);
+  HELAYERS_TIMER_POP();
+
+  const vector<double>& compareVals = plain.getColumn(compareCol);
+  const vector<double>& opVals = plain.getColumn(opCol);
+  verify(dashboard,
+         t.postProcessMultiAggregateQuery(res),
+         plainMultiAggregateQuery(
+             plain,
+             [&](size_t i) {
+               return compareVals[i] >= low && compareVals[i] <= high &&
+                      opVals[i] > opMin;
+             },
+             dashboard));
+}
+
+// Runs "SELECT <compareCol>, <dashboard> GROUP BY <compareCol>" over the
+// given keys as a single query.
+void runGroupByQuery(const EncryptedTable& t,
+                     const PlainTable& plain,
+                     const vector<int>& keys)
+{
+  cout << "GROUP BY " << compareCol << " over " << keys.size() << " keys"
+       << endl;
+
+  HELAYERS_TIMER_PUSH("group by query");
+  GroupByResult res = t.groupByQuery(compareCol, keys, dashboard);
+  HELAYERS_TIMER_POP();
+
+  vector<vector<double>> vals = t.postProcessGroupByQuery(res);
+  for (size_t g = 0; g < keys.size(); ++g) {
+    cout << " " << compareCol << " = " << keys[g] << endl;
+    verify(dashboard,
+           vals[g],
+           plainMultiAggregateQuery(
+               plain, compareCol, keys[g], IS_EQUAL, dashboard));
+  }
+}
+
+// Runs "COUNT *, SUM <opCol> WHERE <compareCol> == val" for every value in
+// vals as a single batch, the way many analysts' queries would be served
+// together.
+void runBatchQuery(const EncryptedTable& t,
+                   const PlainTable& plain,
+                   const vector<double>& vals)
+{
+  cout << "Batch of " << vals.size() << " queries WHERE " << compareCol
+       << " IS_EQUAL val" << endl;
+  const vector<Aggregate> aggregates = {{AGG_COUNT, ""}, {AGG_SUM, opCol}};
+
+  CTile compareVals = t.createBatchCompareValues(vals, compareCol);
+  HELAYERS_TIMER_PUSH("batch query");
+  BatchQueryResult res = t.batchQuery(
+      compareCol, IS_EQUAL, compareVals, vals.size(), aggregates);
+  HELAYERS_TIMER_POP();
+
+  vector<vector<double>> results = t.postProcessBatchQuery(res);
+  for (size_t b = 0; b < vals.size(); ++b) {
+    cout << " " << compareCol << " = " << vals[b] << endl;
+    verify(aggregates,
+           results[b],
+           plainMultiAggregateQuery(
+               plain, compareCol, vals[b], IS_EQUAL, aggregates));
+  }
+}
+
+// Runs the dashboard over a random sample of 10% of the chunks, and refines it
+// to 25%, 50% and all of them, printing the estimates and their 95%
+// confidence intervals along the way.
+void runSampledQuery(const EncryptedTable& t,
+                     const PlainTable& plain,
+                     const Predicate& pred,
+                     double compareValPlain)
+{
+  cout << "Sampled WHERE " << pred.column << " "
+       << compTypeToStr(pred.comparisonType) << " " << compareValPlain
+       << endl;
+  vector<double> expected = plainMultiAggregateQuery(
+      plain, pred.column, compareValPlain, pred.comparisonType, dashboard);
+
+  SampledQueryResult res = t.sampledQuery(pred, dashboard, 0, 1);
+  for (double fraction : {0.1, 0.25, 0.5, 1.0}) {
+    int target = max(1, (int)ceil(fraction * t.getNumChunks()));
+    t.refineSampledQuery(res, target - res.numSampled);
+    vector<ApproximateAggregate> approx = t.postProcessSampledQuery(res);
+    cout << "  " << res.numSampled << " of " << t.getNumChunks()
+         << " chunks:" << endl;
+    for (size_t i = 0; i < dashboard.size(); ++i)
+      cout << "    " << aggregateToStr(dashboard[i])
+           << " estimate: " << approx[i].estimate << " [" << approx[i].low
+           << ", " << approx[i].high << "] expected: " << expected[i] << endl;
+  }
+
+  vector<double> vals;
+  for (const ApproximateAggregate& approx : t.postProcessSampledQuery(res))
+    vals.push_back(approx.estimate);
+  verify(dashboard, vals, expected);
+}
+
+// Computes a histogram of <opCol> over numBuckets - 1 equal-width boundaries
+// in one query, and estimates its quartiles from the bucket counts.
+void runHistogramQuery(const EncryptedTable& t,
+                       const PlainTable& plain,
+                       int numBuckets)
+{
+  const vector<double>& vals = plain.getColumn(opCol);
+  double minVal = *min_element(vals.begin(), vals.end());
+  double maxVal = *max_element(vals.begin(), vals.end());
+  vector<int> boundaries;
+  for (int b = 1; b < numBuckets; ++b)
+    boundaries.push_back(
+        floor(minVal + b * (maxVal + 1 - minVal) / numBuckets));
+  boundaries.erase(unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+  cout << "Histogram of " << opCol << " over " << boundaries.size() + 1
+       << " buckets" << endl;
+
+  HELAYERS_TIMER_PUSH("histogram query");
+  HistogramResult res = t.histogramQuery(opCol, boundaries);
+  HELAYERS_TIMER_POP();
+
+  vector<double> counts = t.postProcessHistogramQuery(res);
+  vector<double> expected(counts.size(), 0);
+  for (double val : vals)
+    expected[upper_bound(boundaries.begin(), boundaries.end(), val) -
+             boundaries.begin()]++;
+  for (size_t b = 0; b < counts.size(); ++b) {
+    cout << "  bucket " << b << " result: " << counts[b]
+         << " expected: " << expected[b] << endl;
+    always_assert(fabs(counts[b] - expected[b]) <=
+                  tolerance * max(1.0, expected[b]));
+  }
+
+  vector<double> sorted = vals;
+  sort(sorted.begin(), sorted.end());
+  vector<double> percentiles = {25, 50, 75};
+  vector<double> estimates = t.estimatePercentiles(res, counts, percentiles);
+  for (size_t i = 0; i < percentiles.size(); ++i)
+    cout << "  p" << percentiles[i] << " estimate: " << estimates[i]
+         << " exact: "
+         << sorted[(size_t)(percentiles[i] / 100 * (sorted.size() - 1))]
+         << endl;
+}
+
+// Encrypts a small customer table with the given client ids, and runs
+// "COUNT *, SUM <opCol> over the transactions JOIN customers USING
+// (<compareCol>)".
+void runJoinQuery(HeContext& he,
+                  const EncryptedTable& t,
+                  const PlainTable& plain,
+                  const vector<double>& customerIds)
+{
+  PlainTable customers;
+  customers.columnNames = {compareCol};
+  customers.columns = {customerIds};
+  EncryptedTable c(he, customers, compareConfig);
+  cout << "JOIN with " << customerIds.size() << " customers ON "
+       << compareCol << endl;
+  const vector<Aggregate> aggregates = {{AGG_COUNT, ""}, {AGG_SUM, opCol}};
+
+  HELAYERS_TIMER_PUSH("join query");
+  MultiAggregateResult res = t.joinQuery(compareCol, c, compareCol, aggregates);
+  HELAYERS_TIMER_POP();
+
+  set<double> ids(customerIds.begin(), customerIds.end());
+  const vector<double>& compareVals = plain.getColumn(compareCol);
+  verify(aggregates,
+         t.postProcessMultiAggregateQuery(res),
+         plainMultiAggregateQuery(
+             plain,
+             [&](size_t i) { return ids.count(compareVals[i]) > 0; },
+             aggregates));
+}
+
+// Runs "SELECT the k largest distinct <opCol> WHERE <pred>", and MIN of
+// <opCol> over the whole table.
+void runTopKQuery(const EncryptedTable& t,
+                  const PlainTable& plain,
+                  const Predicate& pred,
+                  double compareValPlain,
+                  int k)
+{
+  cout << "Top " << k << " " << opCol << " WHERE " << pred.column << " "
+       << compTypeToStr(pred.comparisonType) << " " << compareValPlain
+       << endl;
+  HELAYERS_TIMER_PUSH("top k query");
+  TopKResult res = t.topKQuery(opCol, k, true, pred);
+  HELAYERS_TIMER_POP();
+
+  const vector<double>& compareVals = plain.getColumn(pred.column);
+  const vector<double>& opVals = plain.getColumn(opCol);
+  set<double> matching;
+  for (size_t i = 0; i < opVals.size(); ++i)
+    if (plainMatch(compareVals[i], compareValPlain, pred.comparisonType))
+      matching.insert(opVals[i]);
+  vector<double> vals = t.postProcessTopKQuery(res);
+  auto it = matching.rbegin();
+  for (int i = 0; i < k; ++i) {
+    double expected = it == matching.rend() ? NAN : *it++;
+    cout << "  " << i + 1 << ": " << vals[i] << " expected: " << expected
+         << endl;
+    always_assert(vals[i] == expected ||
+                  (isnan(vals[i]) && isnan(expected)));
+  }
+
+  cout << "MIN " << opCol << endl;
+  HELAYERS_TIMER_PUSH("top k query");
+  res = t.topKQuery(opCol, 1, false);
+  HELAYERS_TIMER_POP();
+  double minVal = t.postProcessTopKQuery(res).at(0);
+  double expected = *min_element(opVals.begin(), opVals.end());
+  cout << "  result: " << minVal << " expected: " << expected << endl;
+  always_assert(minVal == expected);
+}
+
+// Appends a copy of the first numNew rows of the table, deletes every
+// deleteStep-th row, and runs the dashboard again over the updated table.
+void runIncrementalUpdate(EncryptedTable& t,
+                          PlainTable& plain,
+                          const Predicate& pred,
+                          double compareValPlain,
+                          int numNew,
+                          int deleteStep)
+{
+  PlainTable newRows;
+  newRows.columnNames = plain.columnNames;
+  for (const vector<double>& col : plain.columns)
+    newRows.columns.emplace_back(
+        col.begin(), col.begin() + min<size_t>(numNew, col.size()));
+  cout << "Appending " << newRows.columns[0].size() << " rows and deleting "
+       << "every " << deleteStep << "th row" << endl;
+
+  t.appendRows(newRows);
+  for (size_t c = 0; c < plain.columns.size(); ++c)
+    plain.columns[c].insert(plain.columns[c].end(),
+                            newRows.columns[c].begin(),
+                            newRows.columns[c].end());
+
+  vector<int> rows;
+  for (int row = 0; row < t.getNumRows(); row += deleteStep)
+    rows.push_back(row);
+  HELAYERS_TIMER_PUSH("delete rows");
+  t.deleteRows(rows);
+  HELAYERS_TIMER_POP();
+
+  MultiAggregateResult res = t.multiAggregateQuery(pred, dashboard);
+  const vector<double>& compareVals = plain.getColumn(pred.column);
+  verify(dashboard,
+         t.postProcessMultiAggregateQuery(res),
+         plainMultiAggregateQuery(
+             plain,
+             [&](size_t i) {
+               return i % deleteStep != 0 &&
+                      plainMatch(
+                          compareVals[i], compareValPlain, pred.comparisonType);
+             },
+             dashboard));
+}
+
+// Initializes the HE context and the encrypted table. If tableDir holds a
+// saved table, both are loaded from it. Otherwise the table is encrypted, and
+// saved to tableDir if one was given.
+unique_ptr<EncryptedTable> createTable(shared_ptr<HeContext>& he,
+                                       const PlainTable& plain)
+{
+  unique_ptr<EncryptedTable> table;
+  if (!tableDir.empty() && ifstream(tableDir + "/table.bin").good()) {
+    he = loadHeContextFromFile(tableDir + "/context.bin");
+    he->loadSecretKeyFromFile(tableDir + "/secretKey.bin");
+    he->printSignature(cout);
+
+    HELAYERS_TIMER_PUSH("table loading");
+    table = EncryptedTable::loadFromFile(
+        *he, tableDir + "/table.bin", compareConfig);
+    HELAYERS_TIMER_POP();
+    return table;
+  }
+
+  he = initContext(numSlots,
+                   multiplicationDepth,
+                   fractionalPartPrecision,
+                   integerPartPrecision,
+                   mockupContext);
+  he->printSignature(cout);
+
+  // The table is encrypted while it is streamed from the file, unless only
+  // some of its rows are used.
+  HELAYERS_TIMER_PUSH("table encryption");
+  if (maxRows < 0) {
+    ifstream csv(tablePath);
+    table = make_unique<EncryptedTable>(*he, csv, compareConfig, blockRows);
+  } else
+    table = make_unique<EncryptedTable>(*he, plain, compareConfig);
+  HELAYERS_TIMER_POP();
+
+  if (!tableDir.empty()) {
+    cout << "Saving the encrypted table to " << tableDir << endl;
+    FileUtils::createCleanDir(tableDir);
+    he->saveToFile(tableDir + "/context.bin");
+    he->saveSecretKeyToFile(tableDir + "/secretKey.bin");
+    table->saveToFile(tableDir + "/table.bin");
+  }
+  return table;
+}
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--table")
+      tablePath = argv[++i];
+    else if (string(argv[i]) == "--rows")
+      maxRows = atoi(argv[++i]);
+    else if (string(argv[i]) == "--block_rows")
+      blockRows = atoi(argv[++i]);
+    else if (string(argv[i]) == "--table_dir")
+      tableDir = argv[++i];
+    else if (string(argv[i]) == "--g_rep")
+      compareConfig.gRep = atoi(argv[++i]);
+    else if (string(argv[i]) == "--f_rep")
+      compareConfig.fRep = atoi(argv[++i]);
+    else if (string(argv[i]) == "--g_rep_bits")
+      compareConfig.gRepBits = atoi(argv[++i]);
+    else if (string(argv[i]) == "--fixed_compare")
+      compareConfig.adaptive = false;
+    else if (string(argv[i]) == "--tolerance")
+      tolerance = atof(argv[++i]);
+    else if (string(argv[i]) == "--cache_mb")
+      maskCacheMb = atoll(argv[++i]);
+    else if (string(argv[i]) == "--mockup")
+      mockupContext = true;
+    else if (string(argv[i]) == "--slots")
+      numSlots = atoi(argv[++i]);
+    else if (string(argv[i]) == "--depth")
+      multiplicationDepth = atoi(argv[++i]);
+    else if (string(argv[i]) == "--frac")
+      fractionalPartPrecision = atoi(argv[++i]);
+    else if (string(argv[i]) == "--int")
+      integerPartPrecision = atoi(argv[++i]);
+    else if (string(argv[i]) == "--timers")
+      reportAllTimers = true;
+    else {
+      cout << "Unsupported argument: " << argv[i] << endl;
+      help();
+    }
+  }
+
+  // The demo keeps the whole table in the clear to verify the results of
+  // the encrypted queries. Only the encryption of the table is streamed, so
+  // the memory of this process still grows with the table.
+  ifstream ifs(tablePath);
+  if (!ifs.is_open())
+    throw runtime_error("Failed to open table " + tablePath);
+  PlainTable plain = readCsvTable(ifs);
+  if (maxRows >= 0)
+    for (vector<double>& col : plain.columns)
+      if ((int)col.size() > maxRows)
+        col.resize(maxRows);
+
+  shared_ptr<HeContext> he;
+  unique_ptr<EncryptedTable> table = createTable(he, plain);
+  EncryptedTable& t = *table;
+  cout << "Table has " << t.getNumRows() << " rows in " << t.getNumChunks()
+       << " chunks per column" << endl;
+
+  t.setMaskCacheBudget(maskCacheMb * 1024 * 1024);
+  for (const string& col : t.getColumnNames()) {
+    CompareConfig config = t.getColumnCompareConfig(col);
+    cout << "Column " << col << " is compared with g_rep=" << config.gRep
+         << " f_rep=" << config.fRep << endl;
+  }
+
+  int compareValIsEq = 9;
+  int compareValIsGr = 50;
+  HELAYERS_TIMER_PUSH("creating compare values");
+  Predicate predIsEq{
+      compareCol, IS_EQUAL, t.createCompareValue(compareValIsEq, compareCol)};
+  Predicate predIsGr{compareCol,
+                     IS_GREATER,
+                     t.createCompareValue(compareValIsGr, compareCol)};
+  HELAYERS_TIMER_POP();
+
+  runDashboard(t, plain, predIsEq, compareValIsEq);
+  runDashboard(t, plain, predIsGr, compareValIsGr);
+  runSeparateQueries(t, plain, predIsEq, compareValIsEq);
+  runSeparateQueries(t, plain, predIsGr, compareValIsGr);
+  runCompoundQuery(t, plain, 10, 50, 1000);
+  runGroupByQuery(t, plain, {1, 2, 3, 4, 5, 6, 7, 8});
+  runBatchQuery(t, plain, {3, 9, 27, 81});
+  runSampledQuery(t, plain, predIsGr, compareValIsGr);
+  runHistogramQuery(t, plain, 8);
+  runJoinQuery(*he, t, plain, {2, 3, 5, 7, 11, 13});
+  runTopKQuery(t, plain, predIsEq, compareValIsEq, 3);
+  runIncrementalUpdate(t, plain, predIsGr, compareValIsGr, 1000, 100);
+
+  const MaskCache& cache = t.getMaskCache();
+  cout << "Mask cache: " << cache.getHits() << " hits, " << cache.getMisses()
+       << " misses, " << cache.getUsedBytes() / (1024 * 1024) << " MB used"
+       << endl;
+
+  for (const string& col : t.getColumnNames())
+    cout << "Column " << col << " is "
+         << (t.isColumnLoaded(col) ? "loaded" : "not loaded") << endl;
+
+  if (reportAllTimers) {
+    HELAYERS_TIMER_PRINT_MEASURES_SUMMARY();
+  } else {
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("table encryption");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("encrypt row block");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("table loading");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("load column");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("multi aggregate query IS_EQUAL");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("multi aggregate query IS_GREATER");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("separate query IS_EQUAL");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("separate query IS_GREATER");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("compound query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("query thread");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("query reduction");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("group by query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("batch query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("sampled query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("histogram query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("top k query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("join query");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("join thread");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("append rows");
+    HELAYERS_TIMER_PRINT_MEASURE_SUMMARY("delete rows");
+  }
+}
@@ -0,0 +1,105 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/resource.h>
+
+#include "helayers/hebase/openfhe/OpenFheCkksContext.h"
+#include "helayers/hebase/mockup/MockupContext.h"
+#include "fhe_db_utils.h"
+
+using namespace std;
+using namespace helayers;
+
+shared_ptr<HeContext> initContext(int numSlots,
+                                  int multiplicationDepth,
+                                  int fractionalPartPrecision,
+                                  int integerPartPrecision,
+                                  bool mockupContext)
+{
+  HeConfigRequirement req(numSlots,
+                          multiplicationDepth,
+                          fractionalPartPrecision,
+                          integerPartPrecision);
+  req.bootstrappable = true;
+  req.automaticBootstrapping = true;
+
+  shared_ptr<HeContext> he = make_shared<OpenFheCkksContext>();
+
+  if (mockupContext) {
+    shared_ptr<MockupContext> mockup = make_shared<MockupContext>();
+    mockup->setEstimatedMeasures(he->getEstimatedMeasures());
+    he = mockup;
+    req.securityLevel = 0;
+  }
+
+  he->init(req);
+  he->setAutomaticBootstrapping(true);
+  return he;
+}
+
+string compTypeToStr(ComparisonType comparisonType)
+{
+  switch (comparisonType) {
+  case IS_EQUAL:
+    return "IS_EQUAL";
+  case IS_GREATER:
+    return "IS_GREATER";
+  case IS_SMALLER:
+    return "IS_SMALLER";
+  case IS_GREATER_EQUAL:
+    return "IS_GREATER_EQUAL";
+  case IS_SMALLER_EQUAL:
+    return "IS_SMALLER_EQUAL";
+  default:
+    always_assert(false);
+    return "";
+  }
+}
+
+bool plainMatch(double x, double val, ComparisonType comparisonType)
+{
+  switch (comparisonType) {
+  case IS_EQUAL:
+    return x == val;
+  case IS_GREATER:
+    return x > val;
+  case IS_SMALLER:
+    return x < val;
+  case IS_GREATER_EQUAL:
+    return x >= val;
+  case IS_SMALLER_EQUAL:
+    return x <= val;
+  default:
+    always_assert(false);
+    return false;
+  }
+}
+
+int getPeakRamMb()
+{
+  // ru_maxrss is the high-water mark of the resident set size, in KB on Linux
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024;
+}
@@ -0,0 +1,52 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FHE_DB_UTILS_H_
+#define FHE_DB_UTILS_H_
+
+#include <memory>
+#include <string>
+
+#include "helayers/hebase/hebase.h"
+#include "helayers/db/Table.h"
+
+// Helpers shared by the fhe_db_engine example and the fhe_db_benchmark.
+
+/// Initializes a bootstrappable OpenFHE CKKS context with automatic
+/// bootstrapping, or a mockup context that simulates it.
+std::shared_ptr<helayers::HeContext> initContext(int numSlots,
+                                                 int multiplicationDepth,
+                                                 int fractionalPartPrecision,
+                                                 int integerPartPrecision,
+                                                 bool mockupContext);
+
+std::string compTypeToStr(helayers::ComparisonType comparisonType);
+
+/// Whether "x <comparisonType> val" holds, in the clear.
+bool plainMatch(double x, double val, helayers::ComparisonType comparisonType);
+
+/// The peak resident memory of the process so far, in MB.
+int getPeakRamMb();
+
+#endif /* FHE_DB_UTILS_H_ */
@@ -0,0 +1,139 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sstream>
+
+#include "mask_cache.h"
+
+using namespace std;
+using namespace helayers;
+
+MaskKey::MaskKey(const string& column,
+                 ComparisonType comparisonType,
+                 const CTile& compareValue)
+    : column(column), comparisonType(comparisonType)
+{
+  stringstream ss;
+  compareValue.save(ss);
+  this->compareValue = ss.str();
+  compareValueHash = hash<string>{}(this->compareValue);
+}
+
+MaskCache::MaskCache(size_t budgetBytes) : budgetBytes(budgetBytes) {}
+
+void MaskCache::setBudget(size_t budgetBytes)
+{
+  lock_guard<mutex> lock(mtx);
+  this->budgetBytes = budgetBytes;
+  evict(budgetBytes);
+}
+
+size_t MaskCache::getBudget() const
+{
+  lock_guard<mutex> lock(mtx);
+  return budgetBytes;
+}
+
+shared_ptr<const Mask> MaskCache::get(const MaskKey& key)
+{
+  lock_guard<mutex> lock(mtx);
+  Id id(key.column, key.comparisonType, key.compareValueHash);
+  auto it = index.find(id);
+  // A hash collision is treated as a miss
+  if (it == index.end() || it->second->compareValue != key.compareValue) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->mask;
+}
+
+bool MaskCache::contains(const MaskKey& key) const
+{
+  lock_guard<mutex> lock(mtx);
+  Id id(key.column, key.comparisonType, key.compareValueHash);
+  auto it = index.find(id);
+  return it != index.end() && it->second->compareValue == key.compareValue;
+}
+
+void MaskCache::put(const MaskKey& key,
+                    shared_ptr<const Mask> mask,
+                    size_t sizeBytes)
+{
+  lock_guard<mutex> lock(mtx);
+  // The entry also holds the serialized compare value of its key
+  sizeBytes += key.column.size() + key.compareValue.size();
+  if (sizeBytes > budgetBytes)
+    return;
+
+  Id id(key.column, key.comparisonType, key.compareValueHash);
+  auto it = index.find(id);
+  if (it != index.end()) {
+    usedBytes -= it->second->sizeBytes;
+    entries.erase(it->second);
+    index.erase(it);
+  }
+
+  evict(budgetBytes - sizeBytes);
+  entries.push_front(Entry{id, key.compareValue, mask, sizeBytes});
+  index[id] = entries.begin();
+  usedBytes += sizeBytes;
+}
+
+void MaskCache::evict(size_t budget)
+{
+  while (usedBytes > budget) {
+    const Entry& lru = entries.back();
+    usedBytes -= lru.sizeBytes;
+    index.erase(lru.id);
+    entries.pop_back();
+  }
+}
+
+void MaskCache::clear()
+{
+  lock_guard<mutex> lock(mtx);
+  entries.clear();
+  index.clear();
+  usedBytes = 0;
+}
+
+size_t MaskCache::getUsedBytes() const
+{
+  lock_guard<mutex> lock(mtx);
+  return usedBytes;
+}
+
+int MaskCache::getHits() const
+{
+  lock_guard<mutex> lock(mtx);
+  return hits;
+}
+
+int MaskCache::getMisses() const
+{
+  lock_guard<mutex> lock(mtx);
+  return misses;
+}
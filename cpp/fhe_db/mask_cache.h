@@ -0,0 +1,119 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MASK_CACHE_H_
+#define MASK_CACHE_H_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "helayers/hebase/hebase.h"
+#include "helayers/db/Table.h"
+
+/// Identifies the mask of a "<column> <comparisonType> <compareValue>"
+/// predicate. The compare value is identified by its serialized ciphertext,
+/// so only a query that reuses the same encrypted compare value hits the
+/// cache.
+struct MaskKey
+{
+  std::string column;
+  helayers::ComparisonType comparisonType;
+  size_t compareValueHash;
+  std::string compareValue;
+
+  MaskKey(const std::string& column,
+          helayers::ComparisonType comparisonType,
+          const helayers::CTile& compareValue);
+};
+
+/// The per-chunk masks of a predicate.
+typedef std::vector<helayers::CTile> Mask;
+
+/// An LRU cache of encrypted predicate masks, bounded by a memory budget.
+/// All methods are thread safe.
+class MaskCache
+{
+public:
+  explicit MaskCache(size_t budgetBytes = 0);
+
+  /// Sets the memory budget, evicting masks if needed. A budget of 0
+  /// disables the cache.
+  void setBudget(size_t budgetBytes);
+
+  size_t getBudget() const;
+
+  bool isEnabled() const { return getBudget() > 0; }
+
+  /// Returns the cached mask, or nullptr if it is not in the cache.
+  std::shared_ptr<const Mask> get(const MaskKey& key);
+
+  /// Returns true if the mask is in the cache, without counting a hit or a
+  /// miss.
+  bool contains(const MaskKey& key) const;
+
+  /// Adds a mask of the given size in bytes. The size of the key, whose
+  /// serialized compare value is stored with the mask, is added to it. An
+  /// entry larger than the whole budget is not cached.
+  void put(const MaskKey& key,
+           std::shared_ptr<const Mask> mask,
+           size_t sizeBytes);
+
+  void clear();
+
+  size_t getUsedBytes() const;
+
+  int getHits() const;
+
+  int getMisses() const;
+
+private:
+  typedef std::tuple<std::string, helayers::ComparisonType, size_t> Id;
+
+  struct Entry
+  {
+    Id id;
+    std::string compareValue;
+    std::shared_ptr<const Mask> mask;
+    size_t sizeBytes;
+  };
+
+  mutable std::mutex mtx;
+  size_t budgetBytes;
+  size_t usedBytes = 0;
+  int hits = 0;
+  int misses = 0;
+
+  // Most recently used entries first.
+  std::list<Entry> entries;
+  std::map<Id, std::list<Entry>::iterator> index;
+
+  void evict(size_t budget);
+};
+
+#endif
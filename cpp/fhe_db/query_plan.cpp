@@ -0,0 +1,82 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <iomanip>
+#include <sstream>
+
+#include "query_plan.h"
+
+using namespace std;
+using namespace helayers;
+
+static string comparisonTypeToStr(ComparisonType comparisonType)
+{
+  switch (comparisonType) {
+  case IS_EQUAL:
+    return "=";
+  case IS_GREATER:
+    return ">";
+  case IS_SMALLER:
+    return "<";
+  case IS_GREATER_EQUAL:
+    return ">=";
+  case IS_SMALLER_EQUAL:
+    return "<=";
+  default:
+    return "?";
+  }
+}
+
+string compareMethodToStr(CompareMethod method)
+{
+  switch (method) {
+  case CMP_SIGN:
+    return "sign approximation";
+  case CMP_INDICATOR:
+    return "indicator polynomial";
+  case CMP_CACHED:
+    return "cached mask";
+  default:
+    return "unknown";
+  }
+}
+
+void QueryPlan::print(ostream& out) const
+{
+  out << "EXPLAIN" << endl;
+  for (const PredicatePlan& pred : predicates)
+    out << "  predicate " << pred.column << " "
+        << comparisonTypeToStr(pred.comparisonType) << " ?: "
+        << compareMethodToStr(pred.method) << ", depth " << pred.depth << ", "
+        << pred.multiplications << " multiplications per chunk" << endl;
+  out << "  combine: depth " << combineDepth << ", " << combineMultiplications
+      << " multiplications per chunk" << endl;
+  out << "  aggregates: depth " << aggregateDepth << ", "
+      << aggregateMultiplications << " multiplications per chunk" << endl;
+  stringstream latency;
+  latency << fixed << setprecision(3) << predictedLatencySec;
+  out << "  total: depth " << depth << ", " << multiplications
+      << " multiplications over " << numChunks << " chunks, predicted latency "
+      << latency.str() << " s on " << numThreads << " threads" << endl;
+}
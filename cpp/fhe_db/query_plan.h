@@ -0,0 +1,83 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 International Business Machines
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef QUERY_PLAN_H_
+#define QUERY_PLAN_H_
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "helayers/db/Table.h"
+
+/// The ways to evaluate a predicate mask.
+enum CompareMethod
+{
+  // A polynomial approximation of the sign of the difference, see
+  // FunctionEvaluator::compare(). Supports all comparison types.
+  CMP_SIGN,
+  // For IS_EQUAL over a small range of values: the product of 1 - d^2/j^2
+  // for every possible nonzero difference j, which is 1 where the difference
+  // d is 0 and 0 at every other integer.
+  CMP_INDICATOR,
+  // The mask is taken from the mask cache.
+  CMP_CACHED
+};
+
+/// The estimated cost of evaluating a predicate over one chunk.
+struct PredicatePlan
+{
+  std::string column;
+  helayers::ComparisonType comparisonType;
+  CompareMethod method;
+  int depth = 0;
+  int multiplications = 0;
+};
+
+/// The plan of a query over an EncryptedTable, with its estimated
+/// multiplication depth and latency. See EncryptedTable::planQuery().
+struct QueryPlan
+{
+  std::vector<PredicatePlan> predicates;
+  int combineDepth = 0;
+  int combineMultiplications = 0;
+  int aggregateDepth = 0;
+  int aggregateMultiplications = 0;
+
+  int numChunks = 0;
+  int numThreads = 1;
+
+  // The total multiplication depth of the query, and its number of
+  // ciphertext multiplications over all chunks.
+  int depth = 0;
+  long multiplications = 0;
+  double predictedLatencySec = 0;
+
+  /// Prints the plan in a human readable EXPLAIN format.
+  void print(std::ostream& out) const;
+};
+
+std::string compareMethodToStr(CompareMethod method);
+
+#endif